@@ -0,0 +1,78 @@
+// Measures CallbackCollection with 10k listeners, this is not part of the library target.
+//
+// Build from the repository root, tp_utils headers need lib_platform on the include path:
+//   g++ -std=c++17 -O2 -Iinc -I../lib_platform/inc bench/CallbackCollectionBench.cpp -o callbackCollectionBench
+
+#include "tp_utils/CallbackCollection.h"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+using namespace tp_utils;
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+//##################################################################################################
+void report(const char* what, int count, Clock::time_point start)
+{
+  double ms = std::chrono::duration<double, std::milli>(Clock::now()-start).count();
+  printf("%-18s x%-6d %8.3f ms\n", what, count, ms);
+}
+}
+
+//##################################################################################################
+int main()
+{
+  constexpr int listeners{10000};
+  constexpr int emits{100};
+
+  CallbackCollection<void(int)> collection;
+  int64_t sum{0};
+
+  // Connected Callback objects, as used by signals in the rest of the code.
+  std::vector<std::unique_ptr<Callback<void(int)>>> callbacks;
+  callbacks.reserve(listeners);
+
+  auto start = Clock::now();
+  for(int i=0; i<listeners; i++)
+  {
+    callbacks.emplace_back(std::make_unique<Callback<void(int)>>([&](int v){sum+=v;}));
+    callbacks.back()->connect(collection);
+  }
+  report("connect", listeners, start);
+
+  start = Clock::now();
+  for(int i=0; i<emits; i++)
+    collection(1);
+  report("emit", emits, start);
+
+  // Disconnect out of order so that removal can't rely on finding the callback at either end.
+  start = Clock::now();
+  for(int i=0; i<listeners; i+=2)
+    callbacks[size_t(i)].reset();
+  for(int i=listeners-1; i>0; i-=2)
+    callbacks[size_t(i)].reset();
+  report("disconnect", listeners, start);
+
+  // Callbacks owned by the collection and removed by handle.
+  std::vector<CallbackHandle> handles;
+  handles.reserve(listeners);
+
+  start = Clock::now();
+  for(int i=0; i<listeners; i++)
+    handles.push_back(collection.addCallback([&](int v){sum+=v;}));
+  report("add owned", listeners, start);
+
+  start = Clock::now();
+  for(auto handle : handles)
+    collection.removeCallback(handle);
+  report("remove by handle", listeners, start);
+
+  // Keep the calls from being optimized away.
+  printf("sum %lld\n", static_cast<long long>(sum));
+  return 0;
+}
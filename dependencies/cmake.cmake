@@ -3,3 +3,7 @@ if(ANDROID)
 list(APPEND TP_LIBRARIES "-llog")
 endif()
 
+# dladdr() used to symbolize samples in SamplingProfiler, part of libc from glibc 2.34.
+if(CMAKE_SYSTEM_NAME STREQUAL "Linux")
+list(APPEND TP_LIBRARIES ${CMAKE_DL_LIBS})
+endif()
@@ -2,3 +2,7 @@ android{
 LIBS += -llog
 }
 
+# dladdr() used to symbolize samples in SamplingProfiler, part of libc from glibc 2.34.
+linux{
+LIBS += -ldl
+}
@@ -3,8 +3,10 @@
 
 #include "tp_utils/CallbackCollection.h"
 #include "tp_utils/MutexUtils.h"
+#include "tp_utils/LockFreeQueue.h"
 
 #include <thread>
+#include <vector>
 
 namespace tp_utils
 {
@@ -48,15 +50,25 @@ typedef std::unique_ptr<tp_utils::AbstractCrossThreadCallback> TPCrossThreadCall
 namespace tp_utils
 {
 
+//##################################################################################################
+enum class CrossThreadCallbackMode
+{
+  Queued,   //!< The callback is called once for each call().
+  Coalesced //!< Any number of calls before the callback runs are collapsed into a single call.
+};
+
 //##################################################################################################
 class TP_UTILS_EXPORT AbstractCrossThreadCallbackFactory
 {
   TP_NONCOPYABLE(AbstractCrossThreadCallbackFactory);
+  struct BlockingCalls;
+  friend void blockingCrossThreadCall(AbstractCrossThreadCallbackFactory* factory, const std::function<void()>& callback);
   std::thread::id m_mainThreadID{std::this_thread::get_id()};
+  BlockingCalls* m_blockingCalls;
 public:
 
   //################################################################################################
-  AbstractCrossThreadCallbackFactory()=default;
+  AbstractCrossThreadCallbackFactory();
 
   //################################################################################################
   virtual ~AbstractCrossThreadCallbackFactory();
@@ -72,11 +84,16 @@ public:
     return std::unique_ptr<tp_utils::AbstractCrossThreadCallback>(produce(callback));
   }
 
+  //################################################################################################
+  //! Produce a callback in the given mode, Coalesced is useful for change notifications.
+  [[nodiscard]] TPCrossThreadCallback produceP(const std::function<void()>& callback, CrossThreadCallbackMode mode) const;
+
   //################################################################################################
   bool sameThread()
   {
     return m_mainThreadID == std::this_thread::get_id();
   }
+
 };
 
 //##################################################################################################
@@ -110,14 +127,28 @@ private:
 };
 
 //##################################################################################################
-void blockingCrossThreadCall(AbstractCrossThreadCallbackFactory* factory, const std::function<void()>& callback);
+//! Call callback on the thread that services factory and wait for it to return.
+/*!
+Each factory keeps a pool of completion slots, each with a cross thread callback produced by that
+factory, so repeated calls do not allocate. A slot is returned to the pool when the call completes
+and the slots are destroyed with the factory. The caller sleeps on a futex (Linux) or a condition
+variable (elsewhere) and the callback makes at most one wake call.
+
+The slots are destroyed by ~AbstractCrossThreadCallbackFactory(), after any derived factory, so the
+destructors of the callbacks that a factory produces should not touch the factory.
+*/
+void TP_UTILS_EXPORT blockingCrossThreadCall(AbstractCrossThreadCallbackFactory* factory, const std::function<void()>& callback);
 
 //##################################################################################################
+//! Pass payloads from any thread to a callback on the thread that services factory.
+/*!
+Payloads are pushed onto a lock free queue and the consumer drains everything that is pending in
+one go, the cross thread callback is only triggered when the queue goes from empty to not empty.
+*/
 template<typename T>
 class CrossThreadCallbackWithPayload
 {
-  TPMutex m_mutex{TPM};
-  std::vector<T> m_payloads;
+  LockFreeQueue<T> m_payloads;
   std::function<void(T)> m_callback;
   TPCrossThreadCallback m_crossThreadCallback;
 public:
@@ -127,20 +158,63 @@ public:
   {
     m_crossThreadCallback = factory->produceP([&]
     {
-      m_mutex.lock(TPM);
-      T payload = tpTakeFirst(m_payloads);
-      m_mutex.unlock(TPM);
-      m_callback(payload);
+      auto node = m_payloads.takeAll();
+      while(node)
+      {
+        T payload = std::move(node->value);
+        node = m_payloads.deleteNode(node);
+        m_callback(std::move(payload));
+      }
+    });
+  }
+
+  //################################################################################################
+  void call(const T& payload)
+  {
+    if(m_payloads.push(payload))
+      (*m_crossThreadCallback)();
+  }
+
+  //################################################################################################
+  void operator()(const T& payload)
+  {
+    call(payload);
+  }
+};
+
+//##################################################################################################
+//! The same as CrossThreadCallbackWithPayload but the callback receives every pending payload at once.
+template<typename T>
+class CrossThreadBatchCallbackWithPayload
+{
+  LockFreeQueue<T> m_payloads;
+  std::function<void(std::vector<T>&&)> m_callback;
+  TPCrossThreadCallback m_crossThreadCallback;
+public:
+  //################################################################################################
+  CrossThreadBatchCallbackWithPayload(AbstractCrossThreadCallbackFactory* factory, const std::function<void(std::vector<T>&&)>& callback):
+    m_callback(callback)
+  {
+    m_crossThreadCallback = factory->produceP([&]
+    {
+      std::vector<T> payloads;
+      auto node = m_payloads.takeAll();
+      while(node)
+      {
+        payloads.push_back(std::move(node->value));
+        node = m_payloads.deleteNode(node);
+      }
+
+      if(!payloads.empty())
+        m_callback(std::move(payloads));
     });
   }
 
   //################################################################################################
   void call(const T& payload)
   {
-    m_mutex.lock(TPM);
-    m_payloads.push_back(payload);
-    m_mutex.unlock(TPM);
-    (*m_crossThreadCallback)();
+    if(m_payloads.push(payload))
+      (*m_crossThreadCallback)();
   }
 
   //################################################################################################
@@ -3,8 +3,11 @@
 
 #include "tp_utils/CallbackCollection.h"
 
+#include <chrono>
+
 namespace tp_utils
 {
+class AbstractCrossThreadCallbackFactory;
 
 //##################################################################################################
 class TP_UTILS_EXPORT AbstractTimerCallback
@@ -59,20 +62,53 @@ class TimerCallbackFactoryTemplate : public AbstractTimerCallbackFactory
 };
 
 //##################################################################################################
+//! Produces timers that are called from poll().
+/*!
+Timers are kept in a min heap ordered by steady_clock deadline, each poll reads the clock once and
+only visits the timers that have expired. Timers that outlive the factory are no longer called.
+*/
 class TP_UTILS_EXPORT PolledTimerCallbackFactory: public AbstractTimerCallbackFactory
 {
+  TP_DQ;
 public:
   //################################################################################################
   PolledTimerCallbackFactory();
 
+  //################################################################################################
+  ~PolledTimerCallbackFactory() override;
+
   //################################################################################################
   AbstractTimerCallback* produce(const std::function<void()>& callback, int64_t timeOutMS) const override;
 
+  //################################################################################################
+  //! The time that the next timer is due, or time_point::max() if there are no timers.
+  /*!
+  The host event loop can sleep until this time and then call poll().
+  */
+  std::chrono::steady_clock::time_point nextDeadline() const;
+
   //################################################################################################
   Callback<void()> poll;
+};
+
+//##################################################################################################
+//! Produces timers that run on the shared TimerService.
+/*!
+Without a cross thread callback factory the callbacks are called on the timer service thread. If
+crossThreadCallbackFactory is set each timeout is passed through a cross thread callback so that the
+callbacks are called from the thread that services that factory instead.
+*/
+class TP_UTILS_EXPORT TimerServiceCallbackFactory: public AbstractTimerCallbackFactory
+{
+public:
+  //################################################################################################
+  TimerServiceCallbackFactory(AbstractCrossThreadCallbackFactory* crossThreadCallbackFactory=nullptr);
+
+  //################################################################################################
+  AbstractTimerCallback* produce(const std::function<void()>& callback, int64_t timeOutMS) const override;
 
 private:
-  mutable CallbackCollection<void()> m_pollAll;
+  AbstractCrossThreadCallbackFactory* m_crossThreadCallbackFactory;
 };
 
 }
@@ -2,9 +2,11 @@
 #define tp_utils_CallbackCollection_h
 
 #include "tp_utils/Globals.h"
+#include "tp_utils/SmallFunction.h"
 
 #include <memory>
 #include <cassert>
+#include <algorithm>
 
 namespace tp_utils
 {
@@ -18,6 +20,40 @@ template<typename T>
 class Callback;
 
 //##################################################################################################
+template<typename T>
+class ConcurrentCallbackCollection;
+
+//##################################################################################################
+//! Identifies a callback in a CallbackCollection, see CallbackCollection::removeCallback().
+/*!
+The generation is bumped each time a slot is reused so a stale handle is ignored rather than
+removing some other callback.
+*/
+struct CallbackHandle
+{
+  uint32_t index{0};
+  uint32_t generation{0}; //!< 0 is never used by a live callback.
+
+  //################################################################################################
+  bool isValid() const
+  {
+    return generation!=0;
+  }
+};
+
+//##################################################################################################
+//! A list of callbacks that are called in order.
+/*!
+Callbacks are kept in a contiguous array of slots. A slot either points to a std::function owned by
+someone else (a connected Callback or addCallback(std::function*)) or stores a callable that the
+collection owns, small callables are stored inline in the slot without a heap allocation.
+
+Adding a callback returns a CallbackHandle, removing by handle is O(1). Removed slots are left as
+holes and the array is compacted, preserving the order, once more than half of it is holes.
+
+Callbacks can be added and removed from inside a callback. Removed callbacks are not called again,
+and callbacks added during a call are first called on the next call.
+*/
 template<typename R, typename... Args>
 class CallbackCollection<R(Args...)>
 {
@@ -38,83 +74,308 @@ class CallbackCollection<R(Args...)>
   //################################################################################################
   void clear()
   {
-    for(auto unrefCallback : m_unrefCallbacks)
-      (*unrefCallback)(this, nullptr);
+    auto clearSlots = [&](std::vector<Slot>& slots)
+    {
+      for(auto& slot : slots)
+      {
+        if(slot.removed)
+          continue;
 
-    tpDeleteAll(m_nonRemovableCallbacks);
+        if(slot.connected)
+          slot.connected->collectionMoved(this, nullptr, handle(slot));
 
-    m_unrefCallbacks.clear();
-    m_nonRemovableCallbacks.clear();
+        releaseEntry(slot.entry);
+        slot.removed = true;
+      }
+    };
+
+    clearSlots(m_slots);
+    clearSlots(m_pending);
+    m_pending.clear();
+
+    // Owned callables might be running so they are destroyed once dispatch has finished.
+    if(m_dispatchDepth)
+      m_removedCount = m_slots.size();
+    else
+    {
+      m_slots.clear();
+      m_removedCount = 0;
+    }
   }
 
   //################################################################################################
-  void addCallback(std::function<T>* callback)
+  CallbackHandle addCallback(std::function<T>* callback)
   {
     assert(callback);
-    m_callbacks.push_back(callback);
+    return addSlot(Slot(callback));
   }
 
   //################################################################################################
-  void addCallback(std::function<T> callback)
+  //! Add a callback that is owned by the collection.
+  template<typename F, typename = std::enable_if_t<!std::is_pointer_v<std::decay_t<F>>>>
+  CallbackHandle addCallback(F&& callback)
   {
-    assert(callback);
-    m_nonRemovableCallbacks.push_back(new std::function<T>(callback));
-    m_callbacks.push_back(m_nonRemovableCallbacks.back());
+    if constexpr(std::is_same_v<std::decay_t<F>, std::function<T>>)
+      assert(callback);
+    return addSlot(Slot(SmallFunction<T>(std::forward<F>(callback))));
+  }
+
+  //################################################################################################
+  //! Remove a callback, stale or invalid handles are ignored.
+  void removeCallback(CallbackHandle handle)
+  {
+    if(!handle.isValid() || handle.index>=m_entries.size())
+      return;
+
+    const Entry& entry = m_entries[handle.index];
+    if(entry.generation != handle.generation)
+      return;
+
+    if(entry.pending)
+    {
+      m_pending[entry.position].removed = true;
+      releaseEntry(handle.index);
+      return;
+    }
+
+    Slot& slot = m_slots[entry.position];
+    slot.removed = true;
+    releaseEntry(handle.index);
+    m_removedCount++;
+
+    if(!m_dispatchDepth)
+    {
+      slot.owned.reset();
+      compactIfSparse();
+    }
   }
 
   //################################################################################################
+  //! Remove a callback by its address, this is a linear search, prefer removing by handle.
   void removeCallback(std::function<T>* callback)
   {
     assert(callback);
-    tpRemoveOne(m_callbacks, callback);
+
+    for(const auto& slots : {&m_pending, &m_slots})
+    {
+      for(const auto& slot : *slots)
+      {
+        if(!slot.removed && slot.external==callback)
+        {
+          removeCallback(handle(slot));
+          return;
+        }
+      }
+    }
   }
 
   //################################################################################################
   R operator()(Args... args) const
   {
-    if(m_callbacks.empty())
+    if(m_slots.empty())
       return;
 
-    size_t remaining = m_callbacks.size();
+    m_dispatchDepth++;
+    TP_CLEANUP([&]{finishDispatch();});
+
+    // m_slots does not grow or shrink while dispatching so the pointers stay valid.
+    const Slot* s = m_slots.data();
+    const Slot* e = s + m_slots.size();
+    for(; s<e; s++)
+      (*s)(args...);
+
+    return; //Force void
+  }
+
+  //################################################################################################
+  void swap(CallbackCollection<T>& other)
+  {
+    std::swap(m_slots, other.m_slots);
+    std::swap(m_pending, other.m_pending);
+    std::swap(m_entries, other.m_entries);
+    std::swap(m_freeEntries, other.m_freeEntries);
+    std::swap(m_removedCount, other.m_removedCount);
 
-    auto decrement = [&](size_t& r)
+    auto notify = [](CallbackCollection<T>* oc, CallbackCollection<T>* nc)
     {
-      r--;
-      if(m_callbacks.empty())
-      {
-        r=0;
+      for(const auto& slots : {&nc->m_slots, &nc->m_pending})
+        for(const auto& slot : *slots)
+          if(!slot.removed && slot.connected)
+            slot.connected->collectionMoved(oc, nc, nc->handle(slot));
+    };
+
+    notify(&other, this);
+    notify(this, &other);
+  }
+
+  private:
+  //################################################################################################
+  struct Slot
+  {
+    std::function<T>* external{nullptr};
+    SmallFunction<T> owned;
+    Callback<T>* connected{nullptr}; //!< Set if external belongs to a connected Callback.
+    uint32_t entry{0};
+    bool removed{false};
+
+    //##############################################################################################
+    Slot(std::function<T>* external_):
+      external(external_)
+    {
+
+    }
+
+    //##############################################################################################
+    Slot(SmallFunction<T>&& owned_):
+      owned(std::move(owned_))
+    {
+
+    }
+
+    //##############################################################################################
+    void operator()(Args&... args) const
+    {
+      if(removed)
         return;
+
+      if(external)
+      {
+        if(*external)
+          (*external)(args...);
       }
+      else
+        owned(args...);
+    }
+  };
 
-      if(r>=m_callbacks.size())
-        r = m_callbacks.size()-1;
-    };
+  //################################################################################################
+  //! Maps a handle index to a slot, or to the next free entry when it is not in use.
+  struct Entry
+  {
+    uint32_t generation{1};
+    uint32_t position{0};
+    bool pending{false};
+  };
 
-    for(size_t r=remaining; r>0; decrement(r))
-      if(const auto& c=*m_callbacks.at(m_callbacks.size()-r); c)
-        c(args...);
+  //################################################################################################
+  CallbackHandle addSlot(Slot&& slot)
+  {
+    uint32_t index;
+    if(!m_freeEntries.empty())
+    {
+      index = m_freeEntries.back();
+      m_freeEntries.pop_back();
+    }
+    else
+    {
+      index = uint32_t(m_entries.size());
+      m_entries.emplace_back();
+    }
 
-    return; //Force void
+    // Slots are added to a pending list while dispatching so that the array does not move.
+    auto& slots = m_dispatchDepth?m_pending:m_slots;
+
+    Entry& entry = m_entries[index];
+    entry.position = uint32_t(slots.size());
+    entry.pending = m_dispatchDepth!=0;
+
+    slot.entry = index;
+    slots.push_back(std::move(slot));
+    return {index, entry.generation};
   }
 
   //################################################################################################
-  void swap(CallbackCollection<T>& other)
+  CallbackHandle handle(const Slot& slot) const
   {
-    std::swap(m_nonRemovableCallbacks, other.m_nonRemovableCallbacks);
-    std::swap(m_callbacks, other.m_callbacks);
-    std::swap(m_unrefCallbacks, other.m_unrefCallbacks);
+    return {slot.entry, m_entries[slot.entry].generation};
+  }
 
-    for(const auto& callback : m_unrefCallbacks)
-      (*callback)(&other, this);
+  //################################################################################################
+  CallbackHandle connectCallback(Callback<T>* callback)
+  {
+    CallbackHandle handle = addCallback(&callback->m_callback);
+    const Entry& entry = m_entries[handle.index];
+    (entry.pending?m_pending:m_slots)[entry.position].connected = callback;
+    return handle;
+  }
 
-    for(const auto& callback : other.m_unrefCallbacks)
-      (*callback)(this, &other);
+  //################################################################################################
+  void releaseEntry(uint32_t index)
+  {
+    Entry& entry = m_entries[index];
+    entry.generation++;
+    if(entry.generation==0)
+      entry.generation=1;
+    m_freeEntries.push_back(index);
   }
 
-  private:
-  std::vector<std::function<T>*> m_nonRemovableCallbacks;
-  std::vector<std::function<T>*> m_callbacks;
-  std::vector<std::function<void(CallbackCollection<T>*, CallbackCollection<T>*)>*> m_unrefCallbacks;
+  //################################################################################################
+  void compactIfSparse() const
+  {
+    if(m_removedCount<16 || m_removedCount*2<m_slots.size())
+      return;
+
+    size_t o=0;
+    for(size_t i=0; i<m_slots.size(); i++)
+    {
+      if(m_slots[i].removed)
+        continue;
+
+      if(o!=i)
+        m_slots[o] = std::move(m_slots[i]);
+      m_entries[m_slots[o].entry].position = uint32_t(o);
+      o++;
+    }
+
+    m_slots.erase(m_slots.begin()+ptrdiff_t(o), m_slots.end());
+    m_removedCount = 0;
+  }
+
+  //################################################################################################
+  void finishDispatch() const
+  {
+    m_dispatchDepth--;
+    if(m_dispatchDepth)
+      return;
+
+    if(m_removedCount)
+    {
+      // Free anything that was removed during dispatch, the callables are no longer running.
+      for(auto& slot : m_slots)
+        if(slot.removed)
+          slot.owned.reset();
+
+      if(m_removedCount==m_slots.size())
+      {
+        m_slots.clear();
+        m_removedCount = 0;
+      }
+      else
+        compactIfSparse();
+    }
+
+    if(!m_pending.empty())
+    {
+      for(auto& slot : m_pending)
+      {
+        if(slot.removed)
+          continue;
+
+        Entry& entry = m_entries[slot.entry];
+        entry.pending = false;
+        entry.position = uint32_t(m_slots.size());
+        m_slots.push_back(std::move(slot));
+      }
+      m_pending.clear();
+    }
+  }
+
+  mutable std::vector<Slot> m_slots;
+  mutable std::vector<Slot> m_pending;
+  mutable std::vector<Entry> m_entries;
+  std::vector<uint32_t> m_freeEntries;
+  mutable size_t m_removedCount{0};
+  mutable size_t m_dispatchDepth{0};
 };
 
 //##################################################################################################
@@ -156,12 +417,13 @@ class Callback<R(Args...)>
   //################################################################################################
   void disconnect()
   {
-    for(auto c : m_collections)
-    {
-      tpRemoveOne(c->m_unrefCallbacks, &m_unrefCallback);
-      c->removeCallback(&m_callback);
-    }
-    m_collections.clear();
+    for(const auto& c : m_connections)
+      c.first->removeCallback(c.second);
+    m_connections.clear();
+
+    for(const auto& c : m_concurrentConnections)
+      c.remove(c.collection, c.handle);
+    m_concurrentConnections.clear();
   }
 
   //################################################################################################
@@ -179,9 +441,19 @@ class Callback<R(Args...)>
   //################################################################################################
   void connect(CallbackCollection<T>& collection)
   {
-    m_collections.push_back(&collection);
-    collection.m_unrefCallbacks.push_back(&m_unrefCallback);
-    collection.addCallback(&m_callback);
+    m_connections.emplace_back(&collection, collection.connectCallback(this));
+  }
+
+  //################################################################################################
+  //! Connect to a ConcurrentCallbackCollection, see ConcurrentCallbackCollection::addCallback().
+  template<typename C = ConcurrentCallbackCollection<T>>
+  void connect(C& collection)
+  {
+    static_assert(std::is_same_v<C, ConcurrentCallbackCollection<T>>);
+    auto& connection = m_concurrentConnections.emplace_back();
+    connection.collection = &collection;
+    connection.remove = [](void* c, uint64_t handle){static_cast<C*>(c)->removeCallback(handle);};
+    connection.handle = collection.connectCallback(this);
   }
 
   //################################################################################################
@@ -193,16 +465,52 @@ class Callback<R(Args...)>
   }
 
   private:
-  std::function<T> m_callback;
-  std::vector<C> m_collections;
+  template<typename> friend class CallbackCollection;
+  template<typename> friend class ConcurrentCallbackCollection;
 
   //################################################################################################
-  std::function<void(C,C)> m_unrefCallback=[&](C oc, C nc)
+  //! The collection type is erased so that this header does not depend on the concurrent one.
+  struct ConcurrentConnection
   {
-    tpRemoveOne(m_collections, oc);
-    if(nc)
-      m_collections.push_back(nc);
+    void* collection{nullptr};
+    uint64_t handle{0};
+    void (*remove)(void*, uint64_t){nullptr};
   };
+
+  //################################################################################################
+  //! Called by a concurrent collection that is being destroyed.
+  void concurrentCollectionDestroyed(void* collection, uint64_t handle)
+  {
+    for(auto i=m_concurrentConnections.begin(); i!=m_concurrentConnections.end(); ++i)
+    {
+      if(i->collection == collection && i->handle == handle)
+      {
+        m_concurrentConnections.erase(i);
+        return;
+      }
+    }
+  }
+
+  //################################################################################################
+  //! Called by a collection that is being destroyed (nc is null) or swapped.
+  void collectionMoved(C oc, C nc, CallbackHandle handle)
+  {
+    for(auto i=m_connections.begin(); i!=m_connections.end(); ++i)
+    {
+      if(i->first == oc && i->second.index == handle.index && i->second.generation == handle.generation)
+      {
+        if(nc)
+          i->first = nc;
+        else
+          m_connections.erase(i);
+        return;
+      }
+    }
+  }
+
+  std::function<T> m_callback;
+  std::vector<std::pair<C, CallbackHandle>> m_connections;
+  std::vector<ConcurrentConnection> m_concurrentConnections;
 };
 
 }
@@ -0,0 +1,66 @@
+#ifndef tp_utils_ChromeTrace_h
+#define tp_utils_ChromeTrace_h
+
+#include "tp_utils/Progress.h"
+
+#include <iosfwd>
+
+namespace tp_utils
+{
+
+//##################################################################################################
+//! Streams events in the Chrome Trace Event format.
+/*!
+The output can be opened in chrome://tracing, Perfetto (ui.perfetto.dev) and other viewers that
+read the JSON trace format. Events are written to the stream as they are added so large traces do
+not need to be held in memory, the trace is closed by finish() or the destructor.
+
+Ranges are written as complete ("X") events, each track is a thread in the viewer. Colors are passed
+as the nearest reserved Chrome color name and as an exact hex value in the event args.
+*/
+class TP_UTILS_EXPORT ChromeTraceWriter
+{
+  TP_NONCOPYABLE(ChromeTraceWriter);
+  TP_DQ;
+public:
+  //################################################################################################
+  //! Writes the start of the trace, the stream must outlive the writer.
+  ChromeTraceWriter(std::ostream& out, const std::string& processName=std::string());
+
+  //################################################################################################
+  //! Calls finish().
+  ~ChromeTraceWriter();
+
+  //################################################################################################
+  //! Add a named track and return its id.
+  uint64_t addTrack(const std::string& name);
+
+  //################################################################################################
+  //! Add a range to a track, times are in ns.
+  void addRange(uint64_t track, const std::string& name, int64_t startNS, int64_t durationNS, TPPixel color);
+
+  //################################################################################################
+  //! Add a counter ("C") event, each name is drawn as its own counter track.
+  void addCounter(const std::string& name, int64_t timeNS, double value);
+
+  //################################################################################################
+  //! Add progress events to a new track, or a track per thread if the events have several threadIds.
+  /*!
+  Events are nested using parentId and their times. Ranges on a track must nest to display
+  correctly, so events that overlap without nesting (for example ranges from Profiler::addRange())
+  are moved on to additional tracks named trackName (2), trackName (3), etc. The root event is not
+  written.
+  */
+  void addProgressEvents(const std::vector<ProgressEvent>& progressEvents, const std::string& trackName);
+
+  //################################################################################################
+  //! Close the trace, nothing can be added after this.
+  void finish();
+};
+
+//##################################################################################################
+void TP_UTILS_EXPORT saveChromeTrace(const std::vector<ProgressEvent>& progressEvents, std::string& data);
+
+}
+
+#endif
@@ -0,0 +1,351 @@
+#ifndef tp_utils_ConcurrentCallbackCollection_h
+#define tp_utils_ConcurrentCallbackCollection_h
+
+#include "tp_utils/MutexUtils.h"
+#include "tp_utils/CallbackCollection.h"
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+namespace tp_utils
+{
+
+//##################################################################################################
+template <typename T>
+class ConcurrentCallbackCollection;
+
+//##################################################################################################
+//! A thread safe list of callbacks that can be called from any thread without taking a lock.
+/*!
+The callbacks are held in an immutable snapshot. Calling the collection reads the current snapshot
+without locking, adding or removing a callback copies the snapshot, makes the change, and publishes
+the copy. Old snapshots are reclaimed RCU style, callers register against one of two epoch counters
+and a retired snapshot is deleted once every caller that could have seen it has left, so a thread
+that is part way through calling an old snapshot keeps a valid list.
+
+Once removeCallback() returns the callback will not be called again, removing a callback waits for
+calls to it that are running on other threads to return. Callbacks can add and remove callbacks,
+including themselves, while they are being called, a callback is never waited for by the thread that
+is calling it. As with stopping a timer, don't hold a lock that a callback takes while removing it.
+
+Use this when callbacks are emitted from several threads, CallbackCollection is cheaper for signals
+that are only used from a single thread.
+*/
+template<typename R, typename... Args>
+class ConcurrentCallbackCollection<R(Args...)>
+{
+  TP_NONCOPYABLE(ConcurrentCallbackCollection);
+  public:
+  using T = R(Args...);
+  using Handle = uint64_t;
+
+  //################################################################################################
+  ConcurrentCallbackCollection() = default;
+
+  //################################################################################################
+  ~ConcurrentCallbackCollection()
+  {
+    for(const auto& c : m_connected)
+      c.first->concurrentCollectionDestroyed(this, c.second);
+
+    delete m_snapshot.load();
+    for(const auto& i : m_retired)
+      delete i.second;
+  }
+
+  //################################################################################################
+  //! Add a callback, returns a handle that can be passed to removeCallback().
+  Handle addCallback(const std::function<T>& callback)
+  {
+    assert(callback);
+    TP_MUTEX_LOCKER(m_mutex);
+    Handle handle = ++m_nextHandle;
+
+    const Snapshot* current = m_snapshot.load();
+    auto snapshot = current?new Snapshot(*current):new Snapshot();
+
+    snapshot->emplace_back(handle, std::make_shared<Entry>(callback));
+    publish(snapshot);
+    return handle;
+  }
+
+  //################################################################################################
+  //! Add a callback that is owned by the caller, for compatibility with CallbackCollection.
+  /*!
+  The function must stay valid until removeCallback() has returned.
+  */
+  Handle addCallback(std::function<T>* callback)
+  {
+    assert(callback);
+    Handle handle = addCallback([callback](Args... args){(*callback)(args...);});
+    m_mutex.locked(TPMc [&]{m_external.emplace_back(callback, handle);});
+    return handle;
+  }
+
+  //################################################################################################
+  //! Remove a callback added by address, this is a linear search.
+  void removeCallback(std::function<T>* callback)
+  {
+    Handle handle{0};
+    m_mutex.locked(TPMc [&]
+    {
+      if(auto i = std::find_if(m_external.begin(), m_external.end(), [&](const auto& c){return c.first==callback;}); i!=m_external.end())
+        handle = i->second;
+    });
+
+    if(handle)
+      removeCallback(handle);
+  }
+
+  //################################################################################################
+  //! Remove a callback, waiting for calls to it on other threads to return.
+  void removeCallback(Handle handle)
+  {
+    TPMutexLocker lock(m_mutex);
+    forget(m_external, handle);
+    forget(m_connected, handle);
+
+    const Snapshot* current = m_snapshot.load();
+    if(!current)
+      return;
+
+    auto i = std::find_if(current->begin(), current->end(), [&](const auto& c){return c.first==handle;});
+    if(i == current->end())
+      return;
+
+    std::shared_ptr<Entry> entry = i->second;
+
+    Snapshot* snapshot = nullptr;
+    if(current->size()>1)
+    {
+      snapshot = new Snapshot();
+      snapshot->reserve(current->size()-1);
+      snapshot->insert(snapshot->end(), current->begin(), i);
+      snapshot->insert(snapshot->end(), i+1, current->end());
+    }
+
+    publish(snapshot);
+    waitForCalls(lock, *entry);
+  }
+
+  //################################################################################################
+  //! Remove every callback, waiting for calls to them on other threads to return.
+  void clear()
+  {
+    TPMutexLocker lock(m_mutex);
+    m_external.clear();
+    for(const auto& c : m_connected)
+      c.first->concurrentCollectionDestroyed(this, c.second);
+    m_connected.clear();
+
+    Snapshot entries;
+    if(const Snapshot* current = m_snapshot.load(); current)
+      entries = *current;
+
+    publish(nullptr);
+    for(const auto& c : entries)
+      waitForCalls(lock, *c.second);
+  }
+
+  //################################################################################################
+  size_t size() const
+  {
+    size_t parity = acquire();
+    TP_CLEANUP([&]{release(parity);});
+    const Snapshot* snapshot = m_snapshot.load();
+    return snapshot?snapshot->size():0;
+  }
+
+  //################################################################################################
+  R operator()(Args... args) const
+  {
+    // Register as a reader before loading the snapshot so that it can't be deleted while in use.
+    size_t parity = acquire();
+    TP_CLEANUP([&]{release(parity);});
+
+    const Snapshot* snapshot = m_snapshot.load();
+    if(!snapshot)
+      return;
+
+    const CallFrame*& frames = callFrames();
+    for(const auto& c : *snapshot)
+    {
+      Entry& entry = *c.second;
+
+      // Count the call before checking removed, so that either waitForCalls() sees the call or the
+      // call sees that the entry has been removed.
+      entry.calls++;
+      TP_CLEANUP([&]
+      {
+        entry.calls--;
+        if(entry.removed)
+          m_mutex.locked(TPMc [&]{m_callFinished.wakeAll();});
+      });
+
+      if(entry.removed)
+        continue;
+
+      CallFrame frame{&entry, frames};
+      frames = &frame;
+      TP_CLEANUP([&]{frames = frame.next;});
+      entry.callback(args...);
+    }
+
+    return; //Force void
+  }
+
+  private:
+  template<typename> friend class Callback;
+
+  //################################################################################################
+  struct Entry
+  {
+    std::function<T> callback;
+    std::atomic<size_t> calls{0};
+    std::atomic_bool removed{false};
+
+    //##############################################################################################
+    Entry(const std::function<T>& callback_):
+      callback(callback_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  //! The entries that the current thread is calling, innermost first.
+  struct CallFrame
+  {
+    const Entry* entry;
+    const CallFrame* next;
+  };
+
+  using Snapshot = std::vector<std::pair<Handle, std::shared_ptr<Entry>>>;
+
+  //################################################################################################
+  static const CallFrame*& callFrames()
+  {
+    thread_local const CallFrame* callFrames{nullptr};
+    return callFrames;
+  }
+
+  //################################################################################################
+  //! Mark an entry removed and wait for calls on other threads to return, requires m_mutex.
+  void waitForCalls(TPMutexLocker& lock, Entry& entry)
+  {
+    entry.removed = true;
+
+    // Calls further up this thread's stack can't return until this does.
+    size_t ownCalls{0};
+    for(const CallFrame* frame = callFrames(); frame; frame = frame->next)
+      if(frame->entry == &entry)
+        ownCalls++;
+
+    while(entry.calls>ownCalls)
+      m_callFinished.wait(TPMc lock);
+  }
+
+  //################################################################################################
+  //! Called by Callback::connect().
+  Handle connectCallback(Callback<T>* callback)
+  {
+    Handle handle = addCallback(&callback->m_callback);
+    m_mutex.locked(TPMc [&]{m_connected.emplace_back(callback, handle);});
+    return handle;
+  }
+
+  //################################################################################################
+  template<typename V>
+  static void forget(V& v, Handle handle)
+  {
+    v.erase(std::remove_if(v.begin(), v.end(), [&](const auto& c){return c.second==handle;}), v.end());
+  }
+
+  //################################################################################################
+  //! Register a reader against the current epoch, returns the counter to pass to release().
+  size_t acquire() const
+  {
+    for(;;)
+    {
+      uint64_t epoch = m_epoch.load();
+      size_t parity = epoch&1;
+      m_readers[parity].fetch_add(1);
+      if(m_epoch.load()==epoch)
+        return parity;
+      m_readers[parity].fetch_sub(1);
+    }
+  }
+
+  //################################################################################################
+  void release(size_t parity) const
+  {
+    if(m_readers[parity].fetch_sub(1)==1 && m_retiredPending.load())
+    {
+      TP_MUTEX_LOCKER(m_mutex);
+      reclaim();
+    }
+  }
+
+  //################################################################################################
+  //! Publish a new snapshot and retire the old one, requires m_mutex.
+  void publish(Snapshot* snapshot)
+  {
+    if(const Snapshot* old = m_snapshot.exchange(snapshot); old)
+      m_retired.emplace_back(m_epoch.load(), old);
+    reclaim();
+  }
+
+  //################################################################################################
+  //! Advance the epoch where possible and delete snapshots that no reader can see, requires m_mutex.
+  /*!
+  The epoch can advance once there are no readers left from the previous epoch, a snapshot retired
+  in epoch E can be deleted from E+2 because every reader that registered in E or earlier has left.
+  */
+  void reclaim() const
+  {
+    if(m_retired.empty())
+      return;
+
+    // Set the flag before checking the reader counts, either this sees that the previous epoch has
+    // emptied or the last reader to leave it sees the flag and calls reclaim() again.
+    m_retiredPending = true;
+
+    for(int i=0; i<2; i++)
+    {
+      uint64_t epoch = m_epoch.load();
+      if(m_retired.front().first+2 <= epoch || m_readers[(epoch+1)&1].load()!=0)
+        break;
+      m_epoch.store(epoch+1);
+    }
+
+    uint64_t epoch = m_epoch.load();
+    auto i = m_retired.begin();
+    for(; i!=m_retired.end() && i->first+2 <= epoch; ++i)
+      delete i->second;
+    m_retired.erase(m_retired.begin(), i);
+
+    if(m_retired.empty())
+      m_retiredPending = false;
+  }
+
+  std::atomic<const Snapshot*> m_snapshot{nullptr};
+  mutable std::atomic<uint64_t> m_epoch{0};
+  mutable std::atomic<size_t> m_readers[2]{{0}, {0}};
+  mutable std::atomic_bool m_retiredPending{false};
+
+  mutable TPMutex m_mutex{TPM};
+  mutable TPWaitCondition m_callFinished;
+  mutable std::vector<std::pair<uint64_t, const Snapshot*>> m_retired;
+  Handle m_nextHandle{0};
+
+  //! Callbacks that were added by address and connected Callbacks, protected by m_mutex.
+  std::vector<std::pair<std::function<T>*, Handle>> m_external;
+  std::vector<std::pair<Callback<T>*, Handle>> m_connected;
+};
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define tp_utils_DebugUtils_h
 
 #include "tp_utils/CallbackCollection.h"
+#include "tp_utils/ConcurrentCallbackCollection.h"
 
 #include <sstream>
 #include <unordered_set>
@@ -190,8 +191,8 @@ public:
   static Manager& instance();
 
   //################################################################################################
-  // This is not thread safe but we get away with it...
-  CallbackCollection<void(MessageType, const std::string&)> debugCallbacks;
+  //! Messages are logged from any thread so this uses a concurrent collection.
+  ConcurrentCallbackCollection<void(MessageType, const std::string&)> debugCallbacks;
 };
 }
 
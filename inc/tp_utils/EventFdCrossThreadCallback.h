@@ -0,0 +1,60 @@
+#ifndef tp_utils_EventFdCrossThreadCallback_h
+#define tp_utils_EventFdCrossThreadCallback_h
+
+#include "tp_utils/AbstractCrossThreadCallback.h"
+
+#ifdef TP_LINUX
+
+namespace tp_utils
+{
+
+//##################################################################################################
+//! A cross thread callback factory that signals an eventfd when there is work to do.
+/*!
+Add fd() to an epoll or poll loop, when it becomes readable call poll() from the thread that should
+run the callbacks. Callbacks with pending calls are pushed onto a lock free queue, the first push
+onto an empty queue writes to the eventfd and poll() drains the whole queue in one go, so the host
+loop only wakes when there is work and never needs to poll on a timer.
+
+Callbacks should be destroyed on the thread that calls poll().
+
+\code{.cpp}
+tp_utils::EventFdCrossThreadCallbackFactory factory;
+
+epoll_event event{};
+event.events = EPOLLIN;
+epoll_ctl(epollFD, EPOLL_CTL_ADD, factory.fd(), &event);
+
+// When epoll_wait reports factory.fd() as readable.
+factory.poll();
+\endcode
+*/
+class TP_UTILS_EXPORT EventFdCrossThreadCallbackFactory: public AbstractCrossThreadCallbackFactory
+{
+  TP_DQ;
+public:
+  //################################################################################################
+  EventFdCrossThreadCallbackFactory();
+
+  //################################################################################################
+  ~EventFdCrossThreadCallbackFactory() override;
+
+  //################################################################################################
+  //! A non blocking eventfd that becomes readable when there are callbacks waiting to be called.
+  int fd() const;
+
+protected:
+  //################################################################################################
+  AbstractCrossThreadCallback* produce(const std::function<void()>& callback) const override;
+
+public:
+  //################################################################################################
+  //! Reset the eventfd and call every pending callback.
+  Callback<void()> poll;
+};
+
+}
+
+#endif
+
+#endif
@@ -7,8 +7,40 @@
 
 namespace tp_utils
 {
+#ifdef TP_ENABLE_PROFILING
+class Profiler;
+#endif
+
+//##################################################################################################
+enum class GarbagePriority
+{
+  Low,    //!< Run once there is no other garbage, optionally rate limited, see setLowPriorityBytesPerSecond().
+  Normal, //!< The default.
+  High    //!< Run before any other garbage, never coalesced.
+};
 
 //##################################################################################################
+struct GarbageStats
+{
+  size_t pending{0};          //!< The number of closures waiting to run.
+  size_t processed{0};        //!< The total number of closures that have been run.
+  int64_t processingUS{0};    //!< The total time spent running closures.
+  int64_t maxClosureUS{0};    //!< The longest time taken by a single closure since the last resetMaxClosure().
+  int64_t oldestPendingMS{0}; //!< How long the oldest pending closure has been waiting.
+};
+
+//##################################################################################################
+//! Destroy things on a pool of background threads.
+/*!
+Closures with a known size below smallSizeBytes() are coalesced, rather than waking a worker for
+each one they are collected and run as a single task once enough have accumulated or a short time
+has passed.
+
+The pool of workers grows and shrinks with the backlog, see setThreadRange().
+
+If a memory pressure threshold is set and the resident set size grows beyond it, coalescing and rate
+limiting are suspended and the pool grows to its maximum to drain the backlog as fast as it can.
+*/
 class Garbage
 {
   TP_DQ;
@@ -23,12 +55,70 @@ public:
   void garbage(const std::function<void()>& closure);
 
   //################################################################################################
+  //! Queue a closure that will free approximately sizeBytes.
+  void garbage(const std::function<void()>& closure, size_t sizeBytes, GarbagePriority priority=GarbagePriority::Normal);
+
+  //################################################################################################
+  //! Make sure that at least nThreads workers are always running.
   void increaseThreads(size_t nThreads);
+
+  //################################################################################################
+  //! Scale the number of workers between minThreads and maxThreads depending on the backlog.
+  /*!
+  Workers are added while they are all busy and the backlog keeps growing, and workers above
+  minThreads exit after they have been idle for a couple of seconds. The default is 1 to 4.
+  */
+  void setThreadRange(size_t minThreads, size_t maxThreads);
+
+  //################################################################################################
+  //! The number of workers currently running.
+  size_t threadCount() const;
+
+  //################################################################################################
+  //! Drain as fast as possible while VmRSS is above rssBytes, 0 to disable (default).
+  void setMemoryPressureThreshold(size_t rssBytes);
+
+  //################################################################################################
+  //! Limit the rate that low priority garbage is freed at, 0 for no limit (default).
+  void setLowPriorityBytesPerSecond(size_t bytesPerSecond);
+
+  //################################################################################################
+  //! Returns true if the last memory check found VmRSS above the memory pressure threshold.
+  bool memoryPressure() const;
+
+  //################################################################################################
+  //! Return the current stats, everything except maxClosureUS is cumulative.
+  GarbageStats stats() const;
+
+  //################################################################################################
+  //! Start measuring maxClosureUS again, call this after stats() to get the max for each interval.
+  void resetMaxClosure();
+
+#ifdef TP_ENABLE_PROFILING
+  //################################################################################################
+  //! Record each batch of closures as a range in profiler, the profiler must outlive this or be unset.
+  void setProfiler(Profiler* profiler);
+#endif
+
+  //################################################################################################
+  //! Closures smaller than this are coalesced.
+  static constexpr size_t smallSizeBytes(){return 4096;}
 };
 
 //##################################################################################################
 void garbage(const std::function<void()>& closure);
 
+//##################################################################################################
+void garbage(const std::function<void()>& closure, size_t sizeBytes, GarbagePriority priority=GarbagePriority::Normal);
+
+//##################################################################################################
+//! The stats from the global Garbage instance, see Garbage::stats().
+GarbageStats garbageStats();
+
+//##################################################################################################
+//! Reset maxClosureUS in the global Garbage instance, see Garbage::resetMaxClosure().
+void resetGarbageMaxClosure();
+
 }
 
 
@@ -0,0 +1,147 @@
+#ifndef tp_utils_LockFreeQueue_h
+#define tp_utils_LockFreeQueue_h
+
+#include "tp_utils/Globals.h" // IWYU pragma: keep
+
+#include <atomic>
+#include <utility>
+
+namespace tp_utils
+{
+
+//##################################################################################################
+//! An unbounded, intrusive, lock free, multi producer queue.
+/*!
+Producers push with a single CAS onto an atomic list head. Consumers take everything that has been
+pushed in a single atomic exchange and receive it as a linked list in FIFO order. Because consumers
+never pop individual nodes there is no ABA problem, so any number of threads can consume.
+
+push() and empty() are sequentially consistent so they can be paired with an atomic sleeper count
+to skip wake ups when no consumer is waiting.
+
+\code{.cpp}
+tp_utils::LockFreeQueue<std::function<void()>> queue;
+queue.push([]{});
+
+auto node = queue.takeAll();
+while(node)
+{
+  node->value();
+  node = queue.deleteNode(node);
+}
+\endcode
+*/
+template<typename T>
+class LockFreeQueue
+{
+  TP_NONCOPYABLE(LockFreeQueue);
+public:
+  //################################################################################################
+  struct Node
+  {
+    T value;
+    Node* next{nullptr};
+
+    //##############################################################################################
+    template<typename... Args>
+    Node(Args&&... args):
+      value(std::forward<Args>(args)...)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  LockFreeQueue()=default;
+
+  //################################################################################################
+  ~LockFreeQueue()
+  {
+    deleteAll(takeAll());
+  }
+
+  //################################################################################################
+  //! Push a value, returns true if the queue was empty.
+  template<typename... Args>
+  bool push(Args&&... args)
+  {
+    auto node = new Node(std::forward<Args>(args)...);
+    return pushNodes(node, node);
+  }
+
+  //################################################################################################
+  //! Take every node that has been pushed, returns the oldest with the rest linked in FIFO order.
+  /*!
+  The caller owns the returned nodes and should delete them with deleteNode().
+  */
+  Node* takeAll()
+  {
+    Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+
+    Node* first = nullptr;
+    while(node)
+    {
+      Node* next = node->next;
+      node->next = first;
+      first = node;
+      node = next;
+    }
+
+    return first;
+  }
+
+  //################################################################################################
+  //! Split a FIFO list after count nodes, returns the remainder.
+  static Node* split(Node* first, size_t count)
+  {
+    for(; first && count>1; count--)
+      first = first->next;
+
+    if(!first)
+      return nullptr;
+
+    return std::exchange(first->next, nullptr);
+  }
+
+  //################################################################################################
+  //! Delete a node and return the next node in the list.
+  static Node* deleteNode(Node* node)
+  {
+    Node* next = node->next;
+    delete node;
+    return next;
+  }
+
+  //################################################################################################
+  static void deleteAll(Node* node)
+  {
+    while(node)
+      node = deleteNode(node);
+  }
+
+  //################################################################################################
+  bool empty() const
+  {
+    return m_head.load()==nullptr;
+  }
+
+private:
+  //################################################################################################
+  bool pushNodes(Node* newest, Node* oldest)
+  {
+    Node* head = m_head.load(std::memory_order_relaxed);
+    do
+    {
+      oldest->next = head;
+    }
+    while(!m_head.compare_exchange_weak(head, newest, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+    return head==nullptr;
+  }
+
+  std::atomic<Node*> m_head{nullptr};
+};
+
+}
+
+#endif
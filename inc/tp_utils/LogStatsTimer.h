@@ -6,6 +6,7 @@
 #include "tp_utils/detail/log_stats/mutex_time.h"
 #include "tp_utils/detail/log_stats/ref_count.h"
 #include "tp_utils/detail/log_stats/virtual_memory.h"
+#include "tp_utils/detail/log_stats/garbage.h"
 
 #include <functional>
 #include <thread>
@@ -35,6 +36,7 @@ KeyValueLogStatsTimer logStatsTimer(intervalMS);
 addFunctionTimeStatsProducer(logStatsTimer);
 addRefCountStatsProducer(logStatsTimer);
 addMemoryUsageProducer(logStatsTimer);
+addGarbageProducer(logStatsTimer);
 
 \endcode
 */
@@ -76,6 +78,10 @@ inline void addRefCountProducer(detail::KeyValueLogStatsTimer& keyValueStatsTime
 //! Add memory usage to the key value logs.
 inline void addMemoryUsageProducer(detail::KeyValueLogStatsTimer& keyValueStatsTimer);
 
+//##################################################################################################
+//! Add the global Garbage queue depth, throughput and latency to the key value logs.
+inline void addGarbageProducer(detail::KeyValueLogStatsTimer& keyValueStatsTimer);
+
 }
 
 #endif
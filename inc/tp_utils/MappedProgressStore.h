@@ -0,0 +1,56 @@
+#ifndef tp_utils_MappedProgressStore_h
+#define tp_utils_MappedProgressStore_h
+
+#include "tp_utils/Progress.h"
+
+#ifdef TP_LINUX
+
+namespace tp_utils
+{
+
+//##################################################################################################
+//! A progress store that appends fixed size binary records to a memory mapped file.
+/*!
+Each call to initProgressEvent() or updateProgressEvent() appends a record, nothing is serialized
+to JSON while recording and the records are in the page cache as soon as they are written, so the
+trace survives the process crashing. Names are written once to a side table, path + ".names", and
+records refer to them by index.
+
+The record count in the file header is only advanced once a record is complete so loadFile() can be
+used to read the trace from another process while it is still being written. The last record for
+each id wins.
+
+Failure to create or grow the files is reported with tpWarning() and further events are dropped.
+*/
+class TP_UTILS_EXPORT MappedProgressStore : public AbstractProgressStore
+{
+  TP_NONCOPYABLE(MappedProgressStore);
+  TP_DQ;
+public:
+  //################################################################################################
+  //! Create the store, truncating any existing trace at path.
+  MappedProgressStore(const std::string& path);
+
+  //################################################################################################
+  ~MappedProgressStore() override;
+
+  //################################################################################################
+  void initProgressEvent(ProgressEvent& progressEvent) override;
+
+  //################################################################################################
+  void updateProgressEvent(const ProgressEvent& progressEvent) override;
+
+  //################################################################################################
+  //! Write the mapped pages to disk, only needed to survive the machine rather than the process failing.
+  void flush();
+
+  //################################################################################################
+  //! Read the events from a trace, this can be called while another process is writing it.
+  static std::vector<ProgressEvent> loadFile(const std::string& path);
+};
+
+}
+
+#endif
+
+#endif
@@ -315,6 +315,10 @@ public:
   //################################################################################################
   bool wait(TPM_Ac TPMutexLocker& lockedMutex, int64_t ms = INT64_MAX) noexcept;
 
+  //################################################################################################
+  //! The same as wait() but with a timeout in microseconds.
+  bool waitUS(TPM_Ac TPMutexLocker& lockedMutex, int64_t us = INT64_MAX) noexcept;
+
   //################################################################################################
   void wakeOne();
 
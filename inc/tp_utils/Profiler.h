@@ -9,18 +9,113 @@
 #include "json.hpp"
 
 #include <string>
+#include <type_traits>
 
 
 namespace tp_utils
 {
 class Profiler;
 class ProfilerController;
+class ChromeTraceWriter;
 struct ProgressEvent;
 
+//##################################################################################################
+//! The name and color of a range, created once per call site by the PRF_ macros.
+/*!
+A recorded range only holds a pointer to its descriptor, so the descriptor must outlive the
+profiler, the PRF_ macros declare them as function statics.
+*/
+struct ProfilerRangeDescriptor
+{
+  const char* name;
+  TPPixel color;
+  StringID id;
+
+  //################################################################################################
+  //! name must outlive the descriptor, typically it is a string literal.
+  ProfilerRangeDescriptor(const char* name_, TPPixel color_):
+    name(name_),
+    color(color_),
+    id(name_)
+  {
+
+  }
+
+  //################################################################################################
+  //! The name is held by the StringID.
+  ProfilerRangeDescriptor(const StringID& id_, TPPixel color_):
+    name(id_.toString().c_str()),
+    color(color_),
+    id(id_)
+  {
+
+  }
+};
+
+//##################################################################################################
+//! The name of a counter track, created once per call site by PRF_COUNTER.
+struct ProfilerCounterDescriptor
+{
+  const char* name;
+  StringID id;
+
+  //################################################################################################
+  //! name must outlive the descriptor, typically it is a string literal.
+  ProfilerCounterDescriptor(const char* name_):
+    name(name_),
+    id(name_)
+  {
+
+  }
+
+  //################################################################################################
+  //! The name is held by the StringID.
+  ProfilerCounterDescriptor(const StringID& id_):
+    name(id_.toString().c_str()),
+    id(id_)
+  {
+
+  }
+};
+
+//##################################################################################################
+//! A counter value taken from a snapshot, time is from monotonicTimeNS().
+struct ProfilerCounterSample
+{
+  std::string name;
+  int64_t time{0};
+  double value{0.0};
+  uint64_t threadId{0};
+};
+
+namespace detail
+{
+//##################################################################################################
+//! Labels that are const char arrays, such as string literals, get a static descriptor.
+/*!
+The descriptor keeps a pointer to the first label that it sees so the array must have static
+storage. Mutable char buffers are passed as strings and interned instead.
+*/
+template<typename T>
+constexpr bool isStaticRangeLabel = std::is_array_v<std::remove_reference_t<T>> &&
+                                    std::is_const_v<std::remove_extent_t<std::remove_reference_t<T>>>;
+}
+
 //##################################################################################################
 using SummaryGenerator = std::function<void(const Profiler&, std::vector<std::pair<std::string, std::string>>&)>;
 
 //##################################################################################################
+//! Records named ranges for display in a timeline.
+/*!
+Ranges can be recorded from any number of threads. Each thread records into its own buffer without
+locking, the buffers are merged into a single list of events, tagged with the thread that recorded
+them, when a snapshot is taken by viewProgressEvents() or saveState(). Only completed ranges are
+included in a snapshot.
+
+Counters are numeric values such as queue depths or bytes allocated that are sampled at points in
+time alongside the ranges. Each sample is the current value of the counter, samples for a name are
+treated as a single series regardless of the thread that recorded them.
+*/
 class Profiler
 { 
   TP_NONCOPYABLE(Profiler);
@@ -43,14 +138,44 @@ public:
  void setName(const std::string& name);
 
   //################################################################################################
+  //! Start a range on the calling thread, it must be ended by rangePop() on the same thread.
+  void rangePush(const ProfilerRangeDescriptor& descriptor);
+
+  //################################################################################################
+  //! Start a range with a label that is not known at compile time.
+  /*!
+  The label is interned the first time that each thread sees it, prefer the descriptor overload or
+  the PRF_ macros with a string literal.
+  */
   void rangePush(const std::string& label, TPPixel color);
 
   //################################################################################################
   void rangePop();
 
   //################################################################################################
+  //! Add a range that has already finished to the calling thread, start and end are from monotonicTimeNS().
+  void addRange(const ProfilerRangeDescriptor& descriptor, int64_t start, int64_t end);
+
+  //################################################################################################
+  //! Add a range with a label that is not known at compile time, see rangePush().
+  void addRange(const std::string& label, TPPixel color, int64_t start, int64_t end);
+
+  //################################################################################################
+  //! Record the current value of a counter.
+  void counter(const ProfilerCounterDescriptor& descriptor, double value);
+
+  //################################################################################################
+  //! Record a counter with a name that is not known at compile time, see rangePush().
+  void counter(const std::string& name, double value);
+
+  //################################################################################################
+  //! Take a snapshot of the ranges recorded by all threads, ordered by start time.
   void viewProgressEvents(const std::function<void(const std::vector<ProgressEvent>&)>& closure) const;
 
+  //################################################################################################
+  //! Take a snapshot of the counter samples recorded by all threads, ordered by time.
+  void viewCounterSamples(const std::function<void(const std::vector<ProfilerCounterSample>&)>& closure) const;
+
   //################################################################################################
   std::vector<std::pair<std::string, std::string>> summaries() const;
 
@@ -72,6 +197,14 @@ public:
   //################################################################################################
   void saveState(nlohmann::json& j) const;
 
+  //################################################################################################
+  //! Save the counters as an object of name: {"timeNS":[...], "value":[...]}.
+  void saveCountersState(nlohmann::json& j) const;
+
+  //################################################################################################
+  //! Add the recorded ranges to a Chrome trace on a track named after this profiler, and the counters.
+  void saveChromeTrace(ChromeTraceWriter& writer) const;
+
 private:
   friend class ProfilerController;
 };
@@ -81,6 +214,14 @@ class ScopedProfilerRange
 {
   TP_NONCOPYABLE(ScopedProfilerRange);
 public:
+//##################################################################################################
+  ScopedProfilerRange(Profiler* profiler_, const ProfilerRangeDescriptor& descriptor_):
+  profiler(profiler_)
+  {
+    if(profiler)
+      profiler->rangePush(descriptor_);
+  }
+
 //##################################################################################################
   ScopedProfilerRange(Profiler* profiler_, const std::string label_, TPPixel color_):
   profiler(profiler_)
@@ -111,8 +252,20 @@ private:
 #define PRF_ADD_SUMMARY_GENERATOR(profiler, label, calcFunc, printer)
 #endif
 
+// String literal labels get a static descriptor for each call site, the label and color are only
+// evaluated the first time. Other labels are passed through as strings. A const char array label
+// is treated as a literal, so it must have static storage and must not change.
 #ifdef TP_ENABLE_PROFILING
-#define PRF_RANGE_PUSH(profiler, label, ...) if(profiler) profiler->rangePush(label, __VA_ARGS__)
+#define PRF_RANGE_PUSH(profiler, label, ...) if(profiler) [&](auto&& prfProfiler, auto&& prfLabel) \
+{ \
+  if constexpr(tp_utils::detail::isStaticRangeLabel<decltype(prfLabel)>) \
+  { \
+    static const tp_utils::ProfilerRangeDescriptor prfDescriptor(prfLabel, __VA_ARGS__); \
+    prfProfiler->rangePush(prfDescriptor); \
+  } \
+  else \
+    prfProfiler->rangePush(prfLabel, __VA_ARGS__); \
+}(profiler, label)
 #else
 #define PRF_RANGE_PUSH(profiler, label, ...)
 #endif
@@ -124,7 +277,32 @@ private:
 #endif
 
 #ifdef TP_ENABLE_PROFILING
-#define PRF_SCOPED_RANGE(profiler, label, ...) tp_utils::ScopedProfilerRange scopedPrfRange##__FILE__##__LINE__(profiler, label, __VA_ARGS__)
+#define PRF_COUNTER(profiler, name, value) if(profiler) [&](auto&& prfProfiler, auto&& prfName) \
+{ \
+  if constexpr(tp_utils::detail::isStaticRangeLabel<decltype(prfName)>) \
+  { \
+    static const tp_utils::ProfilerCounterDescriptor prfDescriptor(prfName); \
+    prfProfiler->counter(prfDescriptor, double(value)); \
+  } \
+  else \
+    prfProfiler->counter(prfName, double(value)); \
+}(profiler, name)
+#else
+#define PRF_COUNTER(profiler, name, value)
+#endif
+
+#ifdef TP_ENABLE_PROFILING
+#define PRF_SCOPED_RANGE(profiler, label, ...) tp_utils::ScopedProfilerRange TP_CONCAT(scopedPrfRange, __LINE__) = \
+[&](tp_utils::Profiler* prfProfiler, auto&& prfLabel) \
+{ \
+  if constexpr(tp_utils::detail::isStaticRangeLabel<decltype(prfLabel)>) \
+  { \
+    static const tp_utils::ProfilerRangeDescriptor prfDescriptor(prfLabel, __VA_ARGS__); \
+    return tp_utils::ScopedProfilerRange(prfProfiler, prfDescriptor); \
+  } \
+  else \
+    return tp_utils::ScopedProfilerRange(prfProfiler, prfLabel, __VA_ARGS__); \
+}(profiler, label)
 #else
 #define PRF_SCOPED_RANGE(profiler, label, ...)
 #endif
@@ -15,6 +15,9 @@ namespace tp_utils
 {
 class Profiler;
 class ProfilerController;
+#ifdef TP_LINUX
+class SamplingProfiler;
+#endif
 
 //##################################################################################################
 ProfilerController* globalProfilerController();
@@ -40,8 +43,14 @@ public:
   //################################################################################################
   std::shared_ptr<Profiler> profiler(const StringID& id);
 
+#ifdef TP_LINUX
+  //################################################################################################
+  //! The process wide sampling profiler, created on first use.
+  SamplingProfiler* samplingProfiler();
+#endif
+
   //################################################################################################
-  //! Emitted when the list of profilers changes
+  //! Emitted when the list of profilers changes or the sampling profiler starts or stops
   CallbackCollection<void()> changed;
 
 protected:
@@ -3,6 +3,7 @@
 
 #include "tp_utils/CallbackCollection.h"
 #include "tp_utils/TPPixel.h"
+#include "tp_utils/StringID.h"
 
 #include "json.hpp" // IWYU pragma: keep
 
@@ -38,18 +39,21 @@ struct ProgressEvent
 
   size_t id{0};
   size_t parentId{0};
+  uint64_t threadId{0}; //!< The thread that recorded the event or 0 if unknown.
   std::string name;
 
-  int64_t start{0};
-  int64_t end{0};
+  int64_t start{0}; //!< ns from monotonicTimeNS().
+  int64_t end{0};   //!< ns from monotonicTimeNS().
   float fraction{0.0f};
   TPPixel color{176, 215, 136};
   bool active{true};
 
   //################################################################################################
+  //! Saves start and end as ms since the epoch plus startEpochNS and endEpochNS at full resolution.
   void saveState(nlohmann::json& j) const;
 
   //################################################################################################
+  //! Uses startEpochNS and endEpochNS if present, otherwise converts start and end from ms since the epoch.
   void loadState(const nlohmann::json& j);
 };
 
@@ -99,6 +103,48 @@ public:
   static std::vector<ProgressEvent> loadState(const nlohmann::json& j);
 };
 
+//##################################################################################################
+//! A progress store that keeps the most recent events in a fixed size buffer.
+/*!
+The buffer is allocated up front and names are held as StringID so recording does not allocate once
+a name has been seen. When the buffer is full the oldest event is dropped to make room for the new
+one, updates to dropped events are ignored. The root event is kept separately and is never dropped.
+
+saveState() writes the same format as RAMProgressStore.
+*/
+class RingProgressStore : public AbstractProgressStore
+{
+  TP_NONCOPYABLE(RingProgressStore);
+  TP_DQ;
+public:
+  //################################################################################################
+  RingProgressStore(size_t capacity);
+
+  //################################################################################################
+  ~RingProgressStore() override;
+
+  //################################################################################################
+  void initProgressEvent(ProgressEvent& progressEvent) override;
+
+  //################################################################################################
+  void updateProgressEvent(const ProgressEvent& progressEvent) override;
+
+  //################################################################################################
+  //! The root event followed by the retained events, oldest first.
+  void viewProgressEvents(const std::function<void(const std::vector<ProgressEvent>&)>& closure);
+
+  //################################################################################################
+  void saveState(nlohmann::json& j) const;
+
+  //################################################################################################
+  //! The maximum number of events that are retained, not including the root event.
+  size_t capacity() const;
+
+  //################################################################################################
+  //! The number of events that have been dropped to make room for newer events.
+  size_t droppedEvents() const;
+};
+
 //##################################################################################################
 extern AbstractProgressStore* globalProgressStore_;
 
@@ -131,6 +177,16 @@ public:
   //################################################################################################
   virtual ~Progress();
 
+  //################################################################################################
+  //! Deliver at most one change notification per interval, 0 to notify on every change (default).
+  /*!
+  This applies to the whole tree and can be called on any step. Changes made during the interval set
+  a dirty flag on the root and a single notification is delivered once the interval has passed. For
+  thread safe progress that notification is sent from the timer service, for blocking operations it
+  is sent from the next call to poll().
+  */
+  void setMinimumNotificationIntervalMS(int64_t intervalMS);
+
   //################################################################################################
   void setPrintToConsole(bool printToConsole);
 
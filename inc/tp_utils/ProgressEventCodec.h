@@ -0,0 +1,73 @@
+#ifndef tp_utils_ProgressEventCodec_h
+#define tp_utils_ProgressEventCodec_h
+
+#include "tp_utils/Progress.h"
+
+#include <iosfwd>
+
+namespace tp_utils
+{
+
+//##################################################################################################
+//! Writes progress events to a stream in a compact binary format.
+/*!
+The stream starts with a short header and is followed by one record per event, there is no index or
+footer so events can be written as they are produced and the stream can be cut at any record.
+
+ - Names are sent once and then referred to by their index in a dictionary.
+ - id, parentId and start are zig zag varint deltas from the previous event, end is a delta from
+   start so most events cost a byte or two for each.
+ - Colors are packed into 3 bytes (4 if not opaque) and omitted when they match the previous event.
+ - fractions of 0 and 1 are stored as flags, threadId is only sent when it changes.
+ - The header holds the writer's monotonicToEpochOffsetNS() so the decoder can move times on to its
+   own monotonic clock.
+*/
+class TP_UTILS_EXPORT ProgressEventEncoder
+{
+  TP_NONCOPYABLE(ProgressEventEncoder);
+  TP_DQ;
+public:
+  //################################################################################################
+  //! Writes the header, the stream must outlive the encoder.
+  ProgressEventEncoder(std::ostream& out);
+
+  //################################################################################################
+  ~ProgressEventEncoder();
+
+  //################################################################################################
+  void write(const ProgressEvent& progressEvent);
+};
+
+//##################################################################################################
+//! Reads progress events written by ProgressEventEncoder.
+class TP_UTILS_EXPORT ProgressEventDecoder
+{
+  TP_NONCOPYABLE(ProgressEventDecoder);
+  TP_DQ;
+public:
+  //################################################################################################
+  //! Reads the header, the stream must outlive the decoder.
+  ProgressEventDecoder(std::istream& in);
+
+  //################################################################################################
+  ~ProgressEventDecoder();
+
+  //################################################################################################
+  //! Read the next event, returns false at the end of the stream or if the stream is invalid.
+  bool read(ProgressEvent& progressEvent);
+
+  //################################################################################################
+  //! Returns true if the header was invalid or the stream ended part way through a record.
+  bool error() const;
+};
+
+//##################################################################################################
+void TP_UTILS_EXPORT saveProgressEventsBinary(const std::vector<ProgressEvent>& progressEvents, std::string& data);
+
+//##################################################################################################
+//! Load progress events saved in either the binary format or JSON by RAMProgressStore::saveState().
+std::vector<ProgressEvent> TP_UTILS_EXPORT loadProgressEvents(const std::string& data);
+
+}
+
+#endif
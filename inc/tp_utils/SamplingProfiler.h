@@ -0,0 +1,74 @@
+#ifndef tp_utils_SamplingProfiler_h
+#define tp_utils_SamplingProfiler_h
+
+#include "tp_utils/Globals.h"
+
+#if defined(TP_ENABLE_PROFILING) && defined(TP_LINUX)
+
+#include <string>
+
+namespace tp_utils
+{
+class ProfilerController;
+
+//##################################################################################################
+//! A statistical CPU profiler that samples the call stack of whichever thread is using the CPU.
+/*!
+setitimer(ITIMER_PROF) delivers SIGPROF every intervalUS of CPU time consumed by the process, the
+signal handler captures the stack with backtrace() into a preallocated ring buffer, nothing in the
+handler allocates or locks. Samples are moved out of the ring by a timer on the TimerService and
+are only symbolized when collapsedStacks() is called.
+
+SIGPROF is process wide so only one sampling profiler can run at a time, use the one owned by
+ProfilerController::samplingProfiler().
+*/
+class TP_UTILS_EXPORT SamplingProfiler
+{
+  TP_NONCOPYABLE(SamplingProfiler);
+  TP_DQ;
+
+  //################################################################################################
+  SamplingProfiler(ProfilerController* controller);
+public:
+
+  //################################################################################################
+  ~SamplingProfiler();
+
+  //################################################################################################
+  //! Start sampling, returns false if sampling could not be started.
+  bool start(int64_t intervalUS=1000);
+
+  //################################################################################################
+  void stop();
+
+  //################################################################################################
+  bool isRunning() const;
+
+  //################################################################################################
+  //! Discard the samples collected so far.
+  void clear();
+
+  //################################################################################################
+  //! The number of samples collected since the last clear().
+  size_t sampleCount() const;
+
+  //################################################################################################
+  //! Samples lost because the ring buffer was full.
+  size_t droppedSamples() const;
+
+  //################################################################################################
+  //! The samples as collapsed stacks, one "root;...;leaf count" line per unique stack.
+  /*!
+  This is the input format for flamegraph.pl, speedscope and similar tools.
+  */
+  std::string collapsedStacks() const;
+
+private:
+  friend class ProfilerController;
+};
+
+}
+
+#endif
+
+#endif
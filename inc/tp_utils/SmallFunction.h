@@ -0,0 +1,176 @@
+#ifndef tp_utils_SmallFunction_h
+#define tp_utils_SmallFunction_h
+
+#include "tp_utils/Globals.h" // IWYU pragma: keep
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace tp_utils
+{
+
+//##################################################################################################
+template<typename T, size_t InlineSize=4*sizeof(void*)>
+class SmallFunction;
+
+//##################################################################################################
+//! A move only std::function replacement that stores small callables inline.
+/*!
+Callables that fit in InlineSize bytes and can be moved without throwing are stored in the object
+itself, larger callables fall back to a single heap allocation. The default size is large enough to
+hold a std::function or a lambda capturing a few pointers.
+*/
+template<typename R, typename... Args, size_t InlineSize>
+class SmallFunction<R(Args...), InlineSize>
+{
+  //################################################################################################
+  struct Ops
+  {
+    R (*invoke)(void*, Args&&...);
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void*);
+  };
+
+  //################################################################################################
+  template<typename F>
+  static constexpr bool storedInline = sizeof(F)<=InlineSize &&
+                                       alignof(F)<=alignof(std::max_align_t) &&
+                                       std::is_nothrow_move_constructible_v<F>;
+
+  //################################################################################################
+  template<typename F>
+  struct InlineOps
+  {
+    static R invoke(void* s, Args&&... args)
+    {
+      return (*static_cast<F*>(s))(std::forward<Args>(args)...);
+    }
+
+    static void move(void* dst, void* src)
+    {
+      new (dst) F(std::move(*static_cast<F*>(src)));
+      static_cast<F*>(src)->~F();
+    }
+
+    static void destroy(void* s)
+    {
+      static_cast<F*>(s)->~F();
+    }
+
+    static constexpr Ops ops{&invoke, &move, &destroy};
+  };
+
+  //################################################################################################
+  template<typename F>
+  struct HeapOps
+  {
+    static R invoke(void* s, Args&&... args)
+    {
+      return (**static_cast<F**>(s))(std::forward<Args>(args)...);
+    }
+
+    static void move(void* dst, void* src)
+    {
+      new (dst) F*(*static_cast<F**>(src));
+    }
+
+    static void destroy(void* s)
+    {
+      delete *static_cast<F**>(s);
+    }
+
+    static constexpr Ops ops{&invoke, &move, &destroy};
+  };
+
+public:
+  //################################################################################################
+  SmallFunction()=default;
+
+  //################################################################################################
+  template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, SmallFunction>>>
+  SmallFunction(F&& f)
+  {
+    using D = std::decay_t<F>;
+    if constexpr(storedInline<D>)
+    {
+      new (m_storage) D(std::forward<F>(f));
+      m_ops = &InlineOps<D>::ops;
+    }
+    else
+    {
+      new (m_storage) D*(new D(std::forward<F>(f)));
+      m_ops = &HeapOps<D>::ops;
+    }
+  }
+
+  //################################################################################################
+  SmallFunction(SmallFunction&& other) noexcept
+  {
+    moveFrom(other);
+  }
+
+  //################################################################################################
+  SmallFunction& operator=(SmallFunction&& other) noexcept
+  {
+    if(this != &other)
+    {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  //################################################################################################
+  SmallFunction(const SmallFunction&)=delete;
+
+  //################################################################################################
+  SmallFunction& operator=(const SmallFunction&)=delete;
+
+  //################################################################################################
+  ~SmallFunction()
+  {
+    reset();
+  }
+
+  //################################################################################################
+  void reset()
+  {
+    if(m_ops)
+    {
+      m_ops->destroy(m_storage);
+      m_ops = nullptr;
+    }
+  }
+
+  //################################################################################################
+  explicit operator bool() const
+  {
+    return m_ops!=nullptr;
+  }
+
+  //################################################################################################
+  R operator()(Args... args) const
+  {
+    return m_ops->invoke(const_cast<unsigned char*>(m_storage), std::forward<Args>(args)...);
+  }
+
+private:
+  //################################################################################################
+  void moveFrom(SmallFunction& other)
+  {
+    if(other.m_ops)
+    {
+      other.m_ops->move(m_storage, other.m_storage);
+      m_ops = std::exchange(other.m_ops, nullptr);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+  const Ops* m_ops{nullptr};
+};
+
+}
+
+#endif
@@ -28,6 +28,31 @@ int64_t TP_UTILS_EXPORT currentTimeMS();
 \return the current time as us since since the epoch
 */
 int64_t TP_UTILS_EXPORT currentTimeMicroseconds();
+
+//##################################################################################################
+//! Returns ns from a monotonic clock, only useful for measuring intervals.
+/*!
+This is std::chrono::steady_clock, on Linux that is clock_gettime(CLOCK_MONOTONIC) which is served
+from the vDSO using the TSC where the kernel considers it reliable, so it costs a few tens of ns and
+does not enter the kernel.
+*/
+int64_t TP_UTILS_EXPORT monotonicTimeNS();
+
+//##################################################################################################
+//! The ns to add to monotonicTimeNS() to get ns since the epoch, measured once per process.
+/*!
+The monotonic clock counts from an arbitrary point, typically boot, so times that are saved should
+be saved with this offset to be converted correctly by another process or after a reboot.
+*/
+int64_t TP_UTILS_EXPORT monotonicToEpochOffsetNS();
+
+//##################################################################################################
+//! Convert a time from monotonicTimeNS() to ms since the epoch, as returned by currentTimeMS().
+int64_t TP_UTILS_EXPORT monotonicNSToTimeMS(int64_t ns);
+
+//##################################################################################################
+//! Convert ms since the epoch to the equivalent monotonicTimeNS() in this process.
+int64_t TP_UTILS_EXPORT timeMSToMonotonicNS(int64_t ms);
     
 //##################################################################################################
 class TP_UTILS_EXPORT ElapsedTimer
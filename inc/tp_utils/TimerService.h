@@ -0,0 +1,110 @@
+#ifndef tp_utils_TimerService_h
+#define tp_utils_TimerService_h
+
+#include "tp_utils/Globals.h"
+
+#include <memory>
+#include <functional>
+
+namespace tp_utils
+{
+class ServiceTimer;
+
+//##################################################################################################
+//! What a fixed rate timer should do when the callback falls behind by one or more periods.
+enum class MissedTickPolicy
+{
+  Skip,    //!< Drop the missed ticks and wait for the next tick on the original schedule.
+  CatchUp, //!< Call the callback back to back until it has caught up with the schedule.
+  Coalesce //!< Call the callback once for all of the missed ticks then continue on the original schedule.
+};
+
+//##################################################################################################
+struct TimerJitterStats
+{
+  size_t calls{0};         //!< The number of times the callback has been called.
+  size_t missedTicks{0};   //!< Fixed rate ticks that were skipped or coalesced.
+  int64_t totalJitterUS{0};//!< The sum of the time between each deadline and the callback being called.
+  int64_t maxJitterUS{0};  //!< The largest time between a deadline and the callback being called.
+};
+
+//##################################################################################################
+//! Runs any number of timers from a single thread.
+/*!
+Timers are kept in a hierarchical timing wheel, 4 levels of 256 slots with 1ms ticks at the bottom
+level, so starting and stopping a timer is O(1) regardless of how many timers there are. Deadlines
+are kept with microsecond precision and the thread sleeps until the next timer is due, it does not
+tick when there is nothing to do.
+
+All callbacks run on the service thread so they should be short, a slow callback delays every other
+timer on the same service.
+*/
+class TP_UTILS_EXPORT TimerService
+{
+  TP_NONCOPYABLE(TimerService);
+  TP_DQ;
+public:
+  //################################################################################################
+  TimerService(const std::string& threadName);
+
+  //################################################################################################
+  //! Stops the service thread and waits for it to exit.
+  /*!
+  If the last reference to the service is dropped by a timer callback, for example by deleting a
+  timer from its own callback, the service thread is left to finish the callback and exit on its own.
+  */
+  ~TimerService();
+
+  //################################################################################################
+  //! The service shared by TimerThread and TimerServiceCallbackFactory.
+  static std::shared_ptr<TimerService> globalInstance();
+
+private:
+  friend class ServiceTimer;
+};
+
+//##################################################################################################
+//! A repeating timer that runs on a TimerService.
+class TP_UTILS_EXPORT ServiceTimer
+{
+  TP_NONCOPYABLE(ServiceTimer);
+  TP_DQ;
+public:
+  //################################################################################################
+  ServiceTimer(const std::function<void()>& callback,
+               const std::shared_ptr<TimerService>& service=TimerService::globalInstance());
+
+  //################################################################################################
+  //! Stops the timer, waiting for the callback to return if it is running on another thread.
+  /*!
+  A timer can be deleted from its own callback, in that case its internals are freed by the service
+  thread once the callback returns.
+  */
+  ~ServiceTimer();
+
+  //################################################################################################
+  //! (Re)start the timer, the callback is called intervalUS after start and then intervalUS after each call returns.
+  void start(int64_t intervalUS);
+
+  //################################################################################################
+  //! (Re)start the timer with deadlines every intervalUS after start regardless of how long the callback takes.
+  void startFixedRate(int64_t intervalUS, MissedTickPolicy policy=MissedTickPolicy::Skip);
+
+  //################################################################################################
+  //! Stop the timer, waiting for the callback to return if it is running on another thread.
+  void stop();
+
+  //################################################################################################
+  bool isActive() const;
+
+  //################################################################################################
+  //! Return the stats collected since the last call to takeJitterStats() and reset them.
+  TimerJitterStats takeJitterStats();
+
+private:
+  friend class TimerService;
+};
+
+}
+
+#endif
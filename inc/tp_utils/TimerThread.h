@@ -1,22 +1,45 @@
 #ifndef tp_utils_TimerThread_h
 #define tp_utils_TimerThread_h
 
-#include "tp_utils/Globals.h"
+#include "tp_utils/TimerService.h"
+
+#include <chrono>
 
 namespace tp_utils
 {
 
 //##################################################################################################
+//! Call a callback every timeoutMS.
+/*!
+Despite the name this no longer owns a thread, the callback runs on the shared
+TimerService::globalInstance() thread.
+
+Calls are made at a fixed rate, each deadline is a whole number of periods after the timer was
+created, so the time taken by the callback does not add up as drift. If the callback falls behind
+the missed ticks are handled according to a MissedTickPolicy, the default is to skip them.
+*/
 class TP_UTILS_EXPORT TimerThread
 {
   TP_NONCOPYABLE(TimerThread);
   TP_DQ;
 public:
   //################################################################################################
+  TimerThread(const std::function<void()>& callback, int64_t timeoutMS);
+
+  //################################################################################################
+  //! threadName is ignored, the callback runs on the TimerService thread.
   TimerThread(const std::function<void()>& callback, int64_t timeoutMS, const std::string& threadName);
 
+  //################################################################################################
+  //! Call a callback every interval with sub millisecond precision.
+  TimerThread(const std::function<void()>& callback, std::chrono::microseconds interval, MissedTickPolicy policy=MissedTickPolicy::Skip);
+
   //################################################################################################
   virtual ~TimerThread();
+
+  //################################################################################################
+  //! Return the jitter stats collected since the last call and reset them.
+  TimerJitterStats takeJitterStats();
 };
 
 }
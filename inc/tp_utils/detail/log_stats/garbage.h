@@ -0,0 +1,35 @@
+#include "tp_utils/detail/log_stats/impl.h"
+#include "tp_utils/Garbage.h"
+#include "tp_utils/TimeUtils.h"
+
+namespace tp_utils
+{
+
+//##################################################################################################
+inline void addGarbageProducer(detail::KeyValueLogStatsTimer& keyValueStatsTimer)
+{
+  keyValueStatsTimer.addProducer("Garbage ", [previous=GarbageStats(), previousMS=currentTimeMS()]() mutable
+  {
+    GarbageStats stats = garbageStats();
+    resetGarbageMaxClosure();
+    int64_t nowMS = currentTimeMS();
+
+    size_t processed = stats.processed - tpMin(previous.processed, stats.processed);
+    int64_t processingUS = stats.processingUS - tpMin(previous.processingUS, stats.processingUS);
+    int64_t elapsedMS = tpMax(int64_t(1), nowMS-previousMS);
+
+    std::map<std::string, size_t> result;
+    result["Pending"]         = stats.pending;
+    result["Processed"]       = stats.processed;
+    result["PerSecond"]       = size_t((processed*1000) / size_t(elapsedMS));
+    result["AvgClosureUS"]    = processed?size_t(processingUS)/processed:0;
+    result["MaxClosureUS"]    = size_t(stats.maxClosureUS);
+    result["OldestPendingMS"] = size_t(stats.oldestPendingMS);
+
+    previous = stats;
+    previousMS = nowMS;
+    return result;
+  });
+}
+
+}
@@ -1,8 +1,19 @@
 #include "tp_utils/AbstractCrossThreadCallback.h"
 #include "tp_utils/MutexUtils.h"
 
+#include <atomic>
+#include <vector>
 #include <utility>
 
+#ifdef TP_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
 namespace tp_utils
 {
 
@@ -26,8 +37,47 @@ void AbstractCrossThreadCallback::callback() const
   m_callback();
 }
 
+namespace
+{
 //##################################################################################################
-AbstractCrossThreadCallbackFactory::~AbstractCrossThreadCallbackFactory() = default;
+//! Collapses calls into a single call of an inner callback using an atomic pending flag.
+class CoalescedCrossThreadCallback: public AbstractCrossThreadCallback
+{
+public:
+  //################################################################################################
+  CoalescedCrossThreadCallback(const std::function<void()>& callback_, const AbstractCrossThreadCallbackFactory* factory):
+    AbstractCrossThreadCallback(callback_)
+  {
+    m_crossThreadCallback = factory->produceP([this]
+    {
+      // Clear the flag before calling so that calls made during the callback are not lost.
+      if(m_pending.exchange(false, std::memory_order_acq_rel))
+        callback();
+    });
+  }
+
+  //################################################################################################
+  void call() override
+  {
+    if(!m_pending.exchange(true, std::memory_order_acq_rel))
+      m_crossThreadCallback->call();
+  }
+
+private:
+  std::atomic_bool m_pending{false};
+  TPCrossThreadCallback m_crossThreadCallback;
+};
+}
+
+
+//##################################################################################################
+TPCrossThreadCallback AbstractCrossThreadCallbackFactory::produceP(const std::function<void()>& callback, CrossThreadCallbackMode mode) const
+{
+  if(mode == CrossThreadCallbackMode::Coalesced)
+    return std::make_unique<CoalescedCrossThreadCallback>(callback, this);
+
+  return produceP(callback);
+}
 
 namespace
 {
@@ -91,31 +141,132 @@ AbstractCrossThreadCallback* PolledCrossThreadCallbackFactory::produce(const std
   return c;
 }
 
+namespace
+{
 //##################################################################################################
-void blockingCrossThreadCall(AbstractCrossThreadCallbackFactory* factory, const std::function<void()>& callback)
+//! Completion state for a blockingCrossThreadCall(), reused by calls through the same factory.
+struct BlockingCallSlot
 {
-  if(factory->sameThread())
-    return callback();
+  // Pending: the call has not completed.
+  // Sleeping: the call has not completed and the caller is, or is about to be, asleep.
+  // Complete: the callback has returned.
+  enum : uint32_t {Pending=0, Sleeping=1, Complete=2};
+
+  TPCrossThreadCallback crossThreadCallback;
+  const std::function<void()>* callback{nullptr};
+  std::atomic<uint32_t> state{Complete};
+
+#ifndef TP_LINUX
+  std::mutex mutex;
+  std::condition_variable waitCondition;
+#endif
+
+  //################################################################################################
+  void run()
+  {
+    (*callback)();
+
+    // The slot outlives the call so a wake that arrives after the caller has returned is harmless.
+#ifdef TP_LINUX
+    if(state.exchange(Complete, std::memory_order_acq_rel) == Sleeping)
+      syscall(SYS_futex, &state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    if(state.exchange(Complete, std::memory_order_acq_rel) == Sleeping)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      waitCondition.notify_one();
+    }
+#endif
+  }
 
+  //################################################################################################
+  void wait()
+  {
+    // The callback is often quick, give it a moment before going to sleep.
+    for(int i=0; i<64; i++)
+    {
+      if(state.load(std::memory_order_acquire) == Complete)
+        return;
+      std::this_thread::yield();
+    }
+
+    uint32_t expected = Pending;
+    if(!state.compare_exchange_strong(expected, Sleeping, std::memory_order_acq_rel))
+      return;
+
+#ifdef TP_LINUX
+    while(state.load(std::memory_order_acquire) != Complete)
+      syscall(SYS_futex, &state, FUTEX_WAIT_PRIVATE, Sleeping, nullptr, nullptr, 0);
+#else
+    std::unique_lock<std::mutex> lock(mutex);
+    waitCondition.wait(lock, [&]{return state.load(std::memory_order_acquire) == Complete;});
+#endif
+  }
+};
+}
+
+//##################################################################################################
+//! The completion slots used by blockingCrossThreadCall(), one for each concurrent call.
+struct AbstractCrossThreadCallbackFactory::BlockingCalls
+{
   TPMutex mutex{TPM};
-  TPWaitCondition waitCondition;
-  bool called{false};
+  std::vector<std::unique_ptr<BlockingCallSlot>> slots;
+  std::vector<BlockingCallSlot*> idle;
 
-  TPCrossThreadCallback crossThreadCallback = factory->produceP([&]
+  //################################################################################################
+  BlockingCallSlot* acquire(AbstractCrossThreadCallbackFactory* factory)
   {
-    callback();
-    TP_MUTEX_LOCKER(mutex);
-    called = true;
-    waitCondition.wakeAll();
-  });
+    {
+      TP_MUTEX_LOCKER(mutex);
+      if(!idle.empty())
+      {
+        BlockingCallSlot* slot = idle.back();
+        idle.pop_back();
+        return slot;
+      }
+    }
+
+    auto slot = std::make_unique<BlockingCallSlot>();
+    slot->crossThreadCallback = factory->produceP([s=slot.get()]{s->run();});
 
-  (*crossThreadCallback)();
+    TP_MUTEX_LOCKER(mutex);
+    slots.push_back(std::move(slot));
+    return slots.back().get();
+  }
 
+  //################################################################################################
+  void release(BlockingCallSlot* slot)
   {
-    TPMutexLocker lock(mutex);
-    if(!called)
-      waitCondition.wait(TPMc lock);
+    TP_MUTEX_LOCKER(mutex);
+    idle.push_back(slot);
   }
+};
+
+//##################################################################################################
+AbstractCrossThreadCallbackFactory::AbstractCrossThreadCallbackFactory():
+  m_blockingCalls(new BlockingCalls())
+{
+
+}
+
+//##################################################################################################
+AbstractCrossThreadCallbackFactory::~AbstractCrossThreadCallbackFactory()
+{
+  delete m_blockingCalls;
+}
+
+//##################################################################################################
+void blockingCrossThreadCall(AbstractCrossThreadCallbackFactory* factory, const std::function<void()>& callback)
+{
+  if(factory->sameThread())
+    return callback();
+
+  BlockingCallSlot* slot = factory->m_blockingCalls->acquire(factory);
+  slot->callback = &callback;
+  slot->state.store(BlockingCallSlot::Pending, std::memory_order_release);
+  slot->crossThreadCallback->call();
+  slot->wait();
+  factory->m_blockingCalls->release(slot);
 }
 
 }
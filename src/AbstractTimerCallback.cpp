@@ -1,5 +1,8 @@
 #include "tp_utils/AbstractTimerCallback.h"
-#include "tp_utils/TimeUtils.h"
+#include "tp_utils/AbstractCrossThreadCallback.h"
+#include "tp_utils/TimerService.h"
+
+#include <vector>
 
 namespace tp_utils
 {
@@ -38,52 +41,265 @@ AbstractTimerCallbackFactory::~AbstractTimerCallbackFactory() = default;
 
 namespace
 {
+using Clock = std::chrono::steady_clock;
+struct PolledTimerHeap;
+
 //##################################################################################################
-class PolledTimerCallback final : public AbstractTimerCallback
+struct PolledTimer
+{
+  //! The heap that this timer is scheduled in, nullptr once the factory has been destroyed.
+  PolledTimerHeap* owner{nullptr};
+  Clock::time_point deadline;
+  uint64_t sequence{0};
+  size_t index{0};
+  uint64_t firedPoll{0};
+};
+
+//##################################################################################################
+struct PolledTimerHeap
+{
+  using Timer = PolledTimer;
+
+  //! Min heap of timers ordered by deadline, ties are broken by the order they were scheduled in.
+  std::vector<Timer*> heap;
+  uint64_t sequence{0};
+  uint64_t pollCount{0};
+
+  //################################################################################################
+  //! Timers may outlive the factory, detach them so that they no longer touch the heap.
+  ~PolledTimerHeap()
+  {
+    for(Timer* timer : heap)
+      timer->owner = nullptr;
+  }
+
+  //################################################################################################
+  static bool less(const Timer* a, const Timer* b)
+  {
+    return (a->deadline<b->deadline) || (a->deadline==b->deadline && a->sequence<b->sequence);
+  }
+
+  //################################################################################################
+  void place(Timer* timer, size_t index)
+  {
+    heap[index] = timer;
+    timer->index = index;
+  }
+
+  //################################################################################################
+  void siftUp(size_t index)
+  {
+    Timer* timer = heap[index];
+    while(index>0)
+    {
+      size_t parent = (index-1)/2;
+      if(!less(timer, heap[parent]))
+        break;
+      place(heap[parent], index);
+      index = parent;
+    }
+    place(timer, index);
+  }
+
+  //################################################################################################
+  void siftDown(size_t index)
+  {
+    Timer* timer = heap[index];
+    for(;;)
+    {
+      size_t child = index*2+1;
+      if(child>=heap.size())
+        break;
+
+      if(child+1<heap.size() && less(heap[child+1], heap[child]))
+        child++;
+
+      if(!less(heap[child], timer))
+        break;
+
+      place(heap[child], index);
+      index = child;
+    }
+    place(timer, index);
+  }
+
+  //################################################################################################
+  void schedule(Timer* timer, Clock::time_point deadline)
+  {
+    timer->deadline = deadline;
+    timer->sequence = sequence++;
+    timer->index = heap.size();
+    heap.push_back(timer);
+    siftUp(timer->index);
+  }
+
+  //################################################################################################
+  void remove(Timer* timer)
+  {
+    size_t index = timer->index;
+    Timer* last = heap.back();
+    heap.pop_back();
+    if(last == timer)
+      return;
+
+    place(last, index);
+    if(index>0 && less(last, heap[(index-1)/2]))
+      siftUp(index);
+    else
+      siftDown(index);
+  }
+
+  //################################################################################################
+  void reschedule(Timer* timer, Clock::time_point deadline)
+  {
+    remove(timer);
+    schedule(timer, deadline);
+  }
+
+  //################################################################################################
+  void poll();
+};
+
+//##################################################################################################
+class PolledTimerCallback final : public AbstractTimerCallback, public PolledTimer
 {
 public:
   //################################################################################################
-  PolledTimerCallback(const std::function<void()>& callback_, int64_t timeOutMS):
-    AbstractTimerCallback(callback_, timeOutMS),
-    m_nextCall(currentTimeMS() + timeOutMS)
+  PolledTimerCallback(const std::function<void()>& callback_, int64_t timeOutMS, PolledTimerHeap* heap):
+    AbstractTimerCallback(callback_, timeOutMS)
+  {
+    owner = heap;
+    owner->schedule(this, Clock::now() + std::chrono::milliseconds(timeOutMS));
+  }
+
+  //################################################################################################
+  ~PolledTimerCallback() override
+  {
+    if(owner)
+      owner->remove(this);
+  }
+
+  //################################################################################################
+  void setTimeOutMS(int64_t timeOutMS) override
+  {
+    AbstractTimerCallback::setTimeOutMS(timeOutMS);
+    if(owner)
+      owner->reschedule(this, Clock::now() + std::chrono::milliseconds(timeOutMS));
+  }
+
+  //################################################################################################
+  void fire(Clock::time_point now)
+  {
+    owner->reschedule(this, now + std::chrono::milliseconds(timeOutMS()));
+    callback();
+  }
+};
+
+//##################################################################################################
+void PolledTimerHeap::poll()
+{
+  auto now = Clock::now();
+  pollCount++;
+
+  // Each timer fires at most once per poll. Callbacks may create or delete timers so the top of the
+  // heap is checked again after every call.
+  while(!heap.empty())
   {
-    poll.setCallback([&]()
+    Timer* timer = heap.front();
+    if(timer->deadline>now || timer->firedPoll==pollCount)
+      break;
+
+    timer->firedPoll = pollCount;
+    static_cast<PolledTimerCallback*>(timer)->fire(now);
+  }
+}
+
+//##################################################################################################
+class TimerServiceCallback final : public AbstractTimerCallback
+{
+public:
+  //################################################################################################
+  TimerServiceCallback(const std::function<void()>& callback_,
+                       int64_t timeOutMS,
+                       AbstractCrossThreadCallbackFactory* crossThreadCallbackFactory):
+    AbstractTimerCallback(callback_, timeOutMS),
+    m_timer([this]
     {
-      if(currentTimeMS()>=m_nextCall)
-      {
-        m_nextCall = currentTimeMS() + this->timeOutMS();
+      if(m_crossThreadCallback)
+        m_crossThreadCallback->call();
+      else
         callback();
-      }
-    });
+    })
+  {
+    if(crossThreadCallbackFactory)
+      m_crossThreadCallback = crossThreadCallbackFactory->produceP([this]{callback();}, CrossThreadCallbackMode::Coalesced);
+
+    m_timer.start(timeOutMS*1000);
+  }
+
+  //################################################################################################
+  ~TimerServiceCallback() override
+  {
+    // Stop the timer before the cross thread callback that it uses is destroyed.
+    m_timer.stop();
   }
 
   //################################################################################################
   void setTimeOutMS(int64_t timeOutMS) override
   {
     AbstractTimerCallback::setTimeOutMS(timeOutMS);
-    m_nextCall = currentTimeMS() + timeOutMS;
+    m_timer.start(timeOutMS*1000);
   }
 
-  Callback<void()> poll;
-
 private:
-  int64_t m_nextCall;
+  TPCrossThreadCallback m_crossThreadCallback;
+  ServiceTimer m_timer;
+};
+
+}
+
+//##################################################################################################
+struct PolledTimerCallbackFactory::Private
+{
+  PolledTimerHeap timers;
 };
 
+//##################################################################################################
+PolledTimerCallbackFactory::PolledTimerCallbackFactory():
+  d(new Private())
+{
+  poll.setCallback([&]{d->timers.poll();});
 }
 
 //##################################################################################################
-PolledTimerCallbackFactory::PolledTimerCallbackFactory()
+PolledTimerCallbackFactory::~PolledTimerCallbackFactory()
 {
-  poll.setCallback([&]{m_pollAll();});
+  delete d;
 }
 
 //##################################################################################################
 AbstractTimerCallback* PolledTimerCallbackFactory::produce(const std::function<void()>& callback, int64_t timeOutMS) const
 {
-  auto c = new PolledTimerCallback(callback, timeOutMS);
-  c->poll.connect(m_pollAll);
-  return c;
+  return new PolledTimerCallback(callback, timeOutMS, &d->timers);
+}
+
+//##################################################################################################
+std::chrono::steady_clock::time_point PolledTimerCallbackFactory::nextDeadline() const
+{
+  return d->timers.heap.empty()?Clock::time_point::max():d->timers.heap.front()->deadline;
+}
+
+//##################################################################################################
+TimerServiceCallbackFactory::TimerServiceCallbackFactory(AbstractCrossThreadCallbackFactory* crossThreadCallbackFactory):
+  m_crossThreadCallbackFactory(crossThreadCallbackFactory)
+{
+
+}
+
+//##################################################################################################
+AbstractTimerCallback* TimerServiceCallbackFactory::produce(const std::function<void()>& callback, int64_t timeOutMS) const
+{
+  return new TimerServiceCallback(callback, timeOutMS, m_crossThreadCallbackFactory);
 }
 
 }
@@ -0,0 +1,273 @@
+#include "tp_utils/ChromeTrace.h"
+
+#include <ostream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+
+namespace tp_utils
+{
+
+namespace
+{
+//##################################################################################################
+struct ReservedColor
+{
+  const char* name;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+};
+
+//##################################################################################################
+//! The subset of the reserved trace viewer color names that are useful for ranges.
+constexpr ReservedColor reservedColors[]
+{
+  {"thread_state_uninterruptible", 182, 125, 143},
+  {"thread_state_iowait"         , 255, 140,   0},
+  {"thread_state_running"        , 126, 200, 148},
+  {"thread_state_runnable"       , 133, 160, 210},
+  {"thread_state_unknown"        , 199, 155, 125},
+  {"background_memory_dump"      ,   0, 180, 180},
+  {"light_memory_dump"           ,   0,   0, 180},
+  {"detailed_memory_dump"        , 180,   0, 180},
+  {"generic_work"                , 125, 125, 125},
+  {"good"                        ,   0, 125,   0},
+  {"bad"                         , 180, 125,   0},
+  {"terrible"                    , 180,   0,   0},
+  {"black"                       ,   0,   0,   0},
+  {"grey"                        , 221, 221, 221},
+  {"white"                       , 255, 255, 255},
+  {"yellow"                      , 255, 255,   0},
+  {"olive"                       , 100, 100,   0},
+  {"rail_response"               ,  67, 135, 253},
+  {"rail_animation"              , 244,  74,  63},
+  {"rail_idle"                   , 238, 142,   0},
+  {"rail_load"                   ,  13, 168,  97}
+};
+
+//##################################################################################################
+const char* nearestColorName(TPPixel color)
+{
+  const char* result = reservedColors[0].name;
+  int best = INT32_MAX;
+  for(const auto& c : reservedColors)
+  {
+    int dr = int(color.r) - int(c.r);
+    int dg = int(color.g) - int(c.g);
+    int db = int(color.b) - int(c.b);
+    if(int distance = dr*dr + dg*dg + db*db; distance<best)
+    {
+      best = distance;
+      result = c.name;
+    }
+  }
+  return result;
+}
+}
+
+//##################################################################################################
+struct ChromeTraceWriter::Private
+{
+  std::ostream& out;
+  uint64_t nextTrack{1};
+  bool first{true};
+  bool finished{false};
+
+  //################################################################################################
+  Private(std::ostream& out_):
+    out(out_)
+  {
+
+  }
+
+  //################################################################################################
+  void write(const nlohmann::json& j)
+  {
+    if(finished)
+      return;
+
+    if(!first)
+      out << ",\n";
+    first = false;
+    out << j.dump();
+  }
+
+  //################################################################################################
+  void writeMetadata(const char* name, uint64_t tid, const std::string& value)
+  {
+    nlohmann::json j;
+    j["ph"] = "M";
+    j["name"] = name;
+    j["pid"] = 1;
+    j["tid"] = tid;
+    j["args"]["name"] = value;
+    write(j);
+  }
+};
+
+//##################################################################################################
+ChromeTraceWriter::ChromeTraceWriter(std::ostream& out, const std::string& processName):
+  d(new Private(out))
+{
+  d->out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  if(!processName.empty())
+    d->writeMetadata("process_name", 0, processName);
+}
+
+//##################################################################################################
+ChromeTraceWriter::~ChromeTraceWriter()
+{
+  finish();
+  delete d;
+}
+
+//##################################################################################################
+uint64_t ChromeTraceWriter::addTrack(const std::string& name)
+{
+  uint64_t track = d->nextTrack++;
+  d->writeMetadata("thread_name", track, name);
+  return track;
+}
+
+//##################################################################################################
+void ChromeTraceWriter::addRange(uint64_t track, const std::string& name, int64_t startNS, int64_t durationNS, TPPixel color)
+{
+  nlohmann::json j;
+  j["ph"] = "X";
+  j["name"] = name;
+  j["pid"] = 1;
+  j["tid"] = track;
+  // Trace event times are in microseconds, fractions keep sub microsecond ranges visible.
+  j["ts"] = double(startNS)/1000.0;
+  j["dur"] = double(tpMax(int64_t(0), durationNS))/1000.0;
+  j["cname"] = nearestColorName(color);
+  j["args"]["color"] = color.toString();
+  d->write(j);
+}
+
+//##################################################################################################
+void ChromeTraceWriter::addCounter(const std::string& name, int64_t timeNS, double value)
+{
+  nlohmann::json j;
+  j["ph"] = "C";
+  j["name"] = name;
+  j["pid"] = 1;
+  j["ts"] = double(timeNS)/1000.0;
+  j["args"]["value"] = value;
+  d->write(j);
+}
+
+//##################################################################################################
+void ChromeTraceWriter::addProgressEvents(const std::vector<ProgressEvent>& progressEvents, const std::string& trackName)
+{
+  struct Range_lt
+  {
+    const ProgressEvent* event;
+    int64_t start;
+    int64_t end;
+  };
+
+  // Each thread gets its own set of tracks.
+  std::vector<std::pair<uint64_t, std::vector<Range_lt>>> threads;
+  for(const auto& progressEvent : progressEvents)
+  {
+    if(progressEvent.id==0)
+      continue;
+
+    auto thread = std::find_if(threads.begin(), threads.end(), [&](const auto& t){return t.first==progressEvent.threadId;});
+    if(thread==threads.end())
+      thread = threads.emplace(threads.end(), progressEvent.threadId, std::vector<Range_lt>());
+
+    thread->second.push_back({&progressEvent, progressEvent.start, tpMax(progressEvent.start, progressEvent.end)});
+  }
+
+  struct Lane_lt
+  {
+    uint64_t track{0};
+    std::vector<const Range_lt*> stack;
+  };
+
+  auto fits = [](Lane_lt& lane, const Range_lt& range)
+  {
+    // Ranges are sorted by start so anything that ended before this started can't hold later ranges.
+    while(!lane.stack.empty() && lane.stack.back()->end<=range.start && lane.stack.back()->end<range.end)
+      lane.stack.pop_back();
+
+    return lane.stack.empty() || (lane.stack.back()->start<=range.start && lane.stack.back()->end>=range.end);
+  };
+
+  for(auto& [threadId, ranges] : threads)
+  {
+    std::string threadTrackName = trackName;
+    if(threads.size()>1)
+      threadTrackName += " thread " + std::to_string(threadId);
+
+    // Parents start before and end after their children, so this order lets each stack nest.
+    std::stable_sort(ranges.begin(), ranges.end(), [](const auto& a, const auto& b)
+    {
+      return (a.start!=b.start)?(a.start<b.start):(a.end>b.end);
+    });
+
+    std::vector<Lane_lt> lanes;
+    std::unordered_map<size_t, size_t> laneOfEvent;
+
+    for(const auto& range : ranges)
+    {
+      // Prefer the lane that holds the parent so that children are drawn under it.
+      size_t laneIndex = lanes.size();
+      if(auto i=laneOfEvent.find(range.event->parentId); i!=laneOfEvent.end() && fits(lanes.at(i->second), range))
+        laneIndex = i->second;
+      else
+      {
+        for(size_t l=0; l<lanes.size(); l++)
+        {
+          if(fits(lanes.at(l), range))
+          {
+            laneIndex = l;
+            break;
+          }
+        }
+      }
+
+      if(laneIndex==lanes.size())
+      {
+        std::string name = threadTrackName;
+        if(laneIndex>0)
+          name += " (" + std::to_string(laneIndex+1) + ")";
+        lanes.emplace_back().track = addTrack(name);
+      }
+
+      Lane_lt& lane = lanes.at(laneIndex);
+      lane.stack.push_back(&range);
+      laneOfEvent[range.event->id] = laneIndex;
+
+      addRange(lane.track, range.event->name, range.start, range.end-range.start, range.event->color);
+    }
+  }
+}
+
+//##################################################################################################
+void ChromeTraceWriter::finish()
+{
+  if(d->finished)
+    return;
+
+  d->finished = true;
+  d->out << "\n]}\n";
+  d->out.flush();
+}
+
+//##################################################################################################
+void saveChromeTrace(const std::vector<ProgressEvent>& progressEvents, std::string& data)
+{
+  std::ostringstream out;
+  {
+    ChromeTraceWriter writer(out);
+    writer.addProgressEvents(progressEvents, "Progress");
+  }
+  data = out.str();
+}
+
+}
@@ -0,0 +1,153 @@
+#include "tp_utils/EventFdCrossThreadCallback.h"
+
+#ifdef TP_LINUX
+
+#include "tp_utils/DebugUtils.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+namespace tp_utils
+{
+
+namespace
+{
+class EventFdCrossThreadCallback;
+
+//##################################################################################################
+//! Shared with the queue so that a callback can be destroyed while it is still queued.
+struct CallbackState
+{
+  std::atomic<size_t> count{0};
+  std::atomic_bool queued{false};
+
+  //! Only accessed from the thread that calls poll().
+  EventFdCrossThreadCallback* owner{nullptr};
+};
+
+//##################################################################################################
+struct Queue
+{
+  int fd{-1};
+  LockFreeQueue<std::shared_ptr<CallbackState>> pending;
+
+  //################################################################################################
+  void push(const std::shared_ptr<CallbackState>& state)
+  {
+    if(pending.push(state))
+    {
+      uint64_t one=1;
+      while(::write(fd, &one, sizeof(one))<0 && errno==EINTR){}
+    }
+  }
+};
+
+//##################################################################################################
+class EventFdCrossThreadCallback: public AbstractCrossThreadCallback
+{
+public:
+  //################################################################################################
+  EventFdCrossThreadCallback(const std::function<void()>& callback_, Queue* queue):
+    AbstractCrossThreadCallback(callback_),
+    m_queue(queue),
+    m_state(std::make_shared<CallbackState>())
+  {
+    m_state->owner = this;
+  }
+
+  //################################################################################################
+  ~EventFdCrossThreadCallback() override
+  {
+    m_state->owner = nullptr;
+  }
+
+  //################################################################################################
+  void call() override
+  {
+    m_state->count.fetch_add(1, std::memory_order_acq_rel);
+    if(!m_state->queued.exchange(true, std::memory_order_acq_rel))
+      m_queue->push(m_state);
+  }
+
+  //################################################################################################
+  //! Call the callback once for each pending call, returns early if the callback deletes this.
+  static void process(CallbackState* state)
+  {
+    // Clear queued first so that calls made from here on queue the state again.
+    state->queued.store(false, std::memory_order_release);
+    for(size_t c = state->count.exchange(0, std::memory_order_acq_rel); c && state->owner; c--)
+      state->owner->callback();
+  }
+
+private:
+  Queue* m_queue;
+  std::shared_ptr<CallbackState> m_state;
+};
+}
+
+//##################################################################################################
+struct EventFdCrossThreadCallbackFactory::Private
+{
+  Queue queue;
+  bool inPoll{false};
+
+  //################################################################################################
+  void poll()
+  {
+    if(inPoll)
+      return;
+
+    inPoll=true;
+    TP_CLEANUP([&]{inPoll=false;});
+
+    // Read before taking the queue so that a push that lands after takeAll() signals again.
+    uint64_t value=0;
+    while(::read(queue.fd, &value, sizeof(value))<0 && errno==EINTR){}
+
+    auto node = queue.pending.takeAll();
+    while(node)
+    {
+      EventFdCrossThreadCallback::process(node->value.get());
+      node = queue.pending.deleteNode(node);
+    }
+  }
+};
+
+//##################################################################################################
+EventFdCrossThreadCallbackFactory::EventFdCrossThreadCallbackFactory():
+  d(new Private())
+{
+  d->queue.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(d->queue.fd<0)
+    tpWarning() << "Failed to create eventfd: " << std::strerror(errno);
+
+  poll.setCallback([&]{d->poll();});
+}
+
+//##################################################################################################
+EventFdCrossThreadCallbackFactory::~EventFdCrossThreadCallbackFactory()
+{
+  if(d->queue.fd>=0)
+    ::close(d->queue.fd);
+  delete d;
+}
+
+//##################################################################################################
+int EventFdCrossThreadCallbackFactory::fd() const
+{
+  return d->queue.fd;
+}
+
+//##################################################################################################
+AbstractCrossThreadCallback* EventFdCrossThreadCallbackFactory::produce(const std::function<void()>& callback) const
+{
+  return new EventFdCrossThreadCallback(callback, &d->queue);
+}
+
+}
+
+#endif
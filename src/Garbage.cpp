@@ -1,64 +1,551 @@
 #include "tp_utils/Garbage.h"
 #include "tp_utils/MutexUtils.h"
+#include "tp_utils/LockFreeQueue.h"
 #include "tp_utils/detail/StaticState.h"
+#include "tp_utils/detail/log_stats/virtual_memory.h"
+
+#ifdef TP_ENABLE_PROFILING
+#include "tp_utils/Profiler.h"
+#include "tp_utils/TimeUtils.h"
+#endif
 
 #include "lib_platform/SetThreadName.h"
 
 #include <thread>
-#include <queue>
+#include <atomic>
+#include <list>
+#include <array>
+#include <chrono>
 
 namespace tp_utils
 {
 
-#ifndef TP_NO_THREADS
 namespace
 {
+#ifndef TP_NO_THREADS
 //##################################################################################################
 StaticState::Garbage& getStaticState()
 {
   return StaticState::instance()->garbage;
 }
-}
 #endif
 
+//##################################################################################################
+int64_t steadyTimeMS()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//##################################################################################################
+int64_t steadyTimeUS()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//##################################################################################################
+struct Closure_lt
+{
+  std::function<void()> closure;
+  size_t sizeBytes{0};
+  int64_t queuedMS{0};
+
+  //################################################################################################
+  Closure_lt(const std::function<void()>& closure_, size_t sizeBytes_, int64_t queuedMS_):
+    closure(closure_),
+    sizeBytes(sizeBytes_),
+    queuedMS(queuedMS_)
+  {
+
+  }
+};
+
+//##################################################################################################
+//! A lock free queue of closures that also tracks when the oldest closure was queued.
+struct Queue_lt
+{
+  using Node = LockFreeQueue<Closure_lt>::Node;
+
+  LockFreeQueue<Closure_lt> queue;
+  std::atomic<int64_t> oldestMS{0};
+
+  //################################################################################################
+  //! Returns true if the queue was empty.
+  bool push(const std::function<void()>& closure, size_t sizeBytes, int64_t now)
+  {
+    bool first = queue.push(closure, sizeBytes, now);
+    if(first)
+      oldestMS = now;
+    return first;
+  }
+
+  //################################################################################################
+  Node* takeAll()
+  {
+    return queue.takeAll();
+  }
+
+  //################################################################################################
+  bool empty() const
+  {
+    return queue.empty();
+  }
+
+  //################################################################################################
+  static Node* split(Node* first, size_t count)
+  {
+    return LockFreeQueue<Closure_lt>::split(first, count);
+  }
+
+  //################################################################################################
+  static Node* deleteNode(Node* node)
+  {
+    return LockFreeQueue<Closure_lt>::deleteNode(node);
+  }
+};
+
+//##################################################################################################
+//! The part of each batch that a worker has taken but not run yet, indexed by GarbagePriority.
+/*!
+Remainders stay with the worker that took them and are run before it takes anything newer from the
+same queue, so closures run in the order that they were queued.
+*/
+struct Worker_lt
+{
+  std::array<Queue_lt::Node*, 3> remainders{};
+
+  //! When the oldest closure in each remainder was queued, 0 if there is no remainder.
+  std::array<std::atomic<int64_t>, 3> remainderOldestMS{};
+
+  //################################################################################################
+  bool hasRemainder() const
+  {
+    for(auto remainder : remainders)
+      if(remainder)
+        return true;
+    return false;
+  }
+};
+}
+
 //##################################################################################################
 struct Garbage::Private
 {
+  //! The max number of closures a worker takes at once when other workers are waiting.
+  static constexpr size_t batchSize{64};
+
+  //! Coalesced closures are run once there are this many of them.
+  static constexpr size_t coalesceCount{256};
+
+  //! Coalesced closures are run once they add up to this many bytes.
+  static constexpr size_t coalesceBytes{1024*1024};
+
+  //! Coalesced closures are run once the oldest has been waiting this long.
+  static constexpr int64_t coalesceMS{50};
+
+  //! How often to check VmRSS while there is garbage pending.
+  static constexpr int64_t memoryCheckMS{250};
+
+  //! Add a worker when there are more than this many closures pending per worker.
+  static constexpr size_t growBacklog{batchSize};
+
+  //! Workers above minThreads exit after being idle for this long.
+  static constexpr int64_t idleMS{2000};
+
   TPMutex mutex{TPM};
   TPWaitCondition waitCondition;
-  bool finish{false};
-  std::vector<std::thread*> threads;
-  std::queue<std::function<void()>> queue;
+  std::atomic<size_t> sleeping{0};
+  std::atomic<bool> finish{false};
+
+  // Workers remove themselves from threads when they retire and are joined later from retired.
+  std::list<std::thread> threads;
+  std::vector<std::thread> retired;
+  std::atomic<size_t> nThreads{0};
+  std::list<Worker_lt*> workers;
+  std::atomic<size_t> minThreads{1};
+  std::atomic<size_t> maxThreads{4};
+
+  // Indexed by GarbagePriority.
+  std::array<Queue_lt, 3> queues;
+
+  Queue_lt coalesced;
+  std::atomic<size_t> coalescedCount{0};
+  std::atomic<size_t> coalescedBytes{0};
+
+  std::atomic<size_t> lowPriorityBytesPerSecond{0};
+  std::atomic<int64_t> lowPriorityNextMS{0};
+
+  std::atomic<size_t> memoryPressureThresholdKB{0};
+  std::atomic<bool> memoryPressure{false};
+  std::atomic<int64_t> memoryCheckedMS{0};
+
+  std::atomic<size_t> pending{0};
+  std::atomic<size_t> processed{0};
+  std::atomic<int64_t> processingUS{0};
+  std::atomic<int64_t> maxClosureUS{0};
+
+#ifdef TP_ENABLE_PROFILING
+  std::atomic<Profiler*> profiler{nullptr};
+#endif
+
+  //################################################################################################
+  Queue_lt& queue(GarbagePriority priority)
+  {
+    return queues[size_t(priority)];
+  }
+
+  //################################################################################################
+  void wakeOne()
+  {
+    // Only make the wake syscall if a worker is parked, sleeping is incremented under the mutex
+    // before the queues are checked so taking the mutex here means the wake can't be missed.
+    if(sleeping.load()==0)
+      return;
+
+    mutex.locked(TPMc []{});
+    waitCondition.wakeOne();
+  }
+
+  //################################################################################################
+  void push(const std::function<void()>& closure, size_t sizeBytes, GarbagePriority priority)
+  {
+    pending++;
+    int64_t now = steadyTimeMS();
+
+    if(priority!=GarbagePriority::High && sizeBytes<smallSizeBytes())
+    {
+      // Only wake a worker when the batch starts, so that it can time the batch, and when the batch
+      // is full.
+      bool first = coalesced.push(closure, sizeBytes, now);
+      size_t count = coalescedCount.fetch_add(1) + 1;
+      size_t bytes = coalescedBytes.fetch_add(sizeBytes) + sizeBytes;
+      if(first || count==coalesceCount || (bytes>=coalesceBytes && bytes-sizeBytes<coalesceBytes))
+        wakeOne();
+      return;
+    }
+
+    queue(priority).push(closure, sizeBytes, now);
+    wakeOne();
+    growIfBehind();
+  }
 
   //################################################################################################
+  //! Add a worker if they are all busy and the backlog is growing.
+  void growIfBehind()
+  {
+    size_t n = nThreads;
+    if(n>=maxThreads || sleeping.load()!=0)
+      return;
+
+    size_t backlog = pending - tpMin(size_t(pending), size_t(coalescedCount));
+    if(!drainAll() && backlog<n*growBacklog)
+      return;
+
+    TP_MUTEX_LOCKER(mutex);
+    if(nThreads<maxThreads && sleeping.load()==0)
+      addThread();
+  }
+
+  //################################################################################################
+  //! True if garbage should be processed as fast as possible.
+  bool drainAll() const
+  {
+    return finish || memoryPressure;
+  }
+
+  //################################################################################################
+  void checkMemoryPressure()
+  {
+    size_t thresholdKB = memoryPressureThresholdKB;
+    if(thresholdKB==0)
+      return;
+
+    int64_t now = steadyTimeMS();
+    int64_t checked = memoryCheckedMS;
+    if(now-checked<memoryCheckMS || !memoryCheckedMS.compare_exchange_strong(checked, now))
+      return;
+
+    // VmRSS is -1 if it could not be read, leave the current state alone rather than guess.
+    detail::VirtualMemory virtualMemory;
+    if(virtualMemory.VmRSS==size_t(-1))
+      return;
+
+    bool pressure = virtualMemory.VmRSS>thresholdKB;
+    if(memoryPressure.exchange(pressure) != pressure && pressure)
+    {
+      TP_MUTEX_LOCKER(mutex);
+      while(nThreads<maxThreads)
+        addThread();
+      waitCondition.wakeAll();
+    }
+  }
+
+  //################################################################################################
+  //! True if worker has a remainder or the queue has closures for priority.
+  bool hasWork(const Worker_lt& worker, GarbagePriority priority) const
+  {
+    return worker.remainders[size_t(priority)] || !queues[size_t(priority)].empty();
+  }
+
+  //################################################################################################
+  //! Returns 0 if there is work that can run now, otherwise the ms to wait before checking again.
+  int64_t runnableInMS(const Worker_lt& worker) const
+  {
+    if(hasWork(worker, GarbagePriority::High) || hasWork(worker, GarbagePriority::Normal))
+      return 0;
+
+    bool drain = drainAll();
+    int64_t now = steadyTimeMS();
+    int64_t waitMS = INT64_MAX;
+
+    if(!coalesced.empty())
+    {
+      if(drain || coalescedCount>=coalesceCount || coalescedBytes>=coalesceBytes)
+        return 0;
+      waitMS = tpMin(waitMS, tpMax(int64_t(1), (coalesced.oldestMS+coalesceMS)-now));
+    }
+
+    if(hasWork(worker, GarbagePriority::Low))
+    {
+      if(drain || now>=lowPriorityNextMS)
+        return 0;
+      waitMS = tpMin(waitMS, lowPriorityNextMS-now);
+    }
+
+    if(waitMS!=INT64_MAX && memoryPressureThresholdKB!=0)
+      waitMS = tpMin(waitMS, memoryCheckMS);
+
+    return waitMS;
+  }
+
+  //################################################################################################
+  //! Take the next batch of closures for priority.
+  /*!
+  Batches are limited to batchSize so that higher priority garbage is checked regularly, the rest is
+  kept by the worker and run before anything newer is taken from the queue.
+  */
+  Queue_lt::Node* takeBatch(Worker_lt& worker, GarbagePriority priority)
+  {
+    size_t i = size_t(priority);
+    Queue_lt::Node* node = worker.remainders[i];
+    if(!node)
+      node = queues[i].takeAll();
+
+    if(!node)
+      return nullptr;
+
+    Queue_lt::Node* remainder = Queue_lt::split(node, batchSize);
+    worker.remainders[i] = remainder;
+    worker.remainderOldestMS[i] = remainder?remainder->value.queuedMS:0;
+    return node;
+  }
+
+  //################################################################################################
+  //! Returns the next batch of work that can run now.
+  Queue_lt::Node* takeWork(Worker_lt& worker, bool& lowPriority)
+  {
+    lowPriority = false;
+
+    for(auto priority : {GarbagePriority::High, GarbagePriority::Normal})
+      if(auto node = takeBatch(worker, priority); node)
+        return node;
+
+    bool drain = drainAll();
+
+    if(!coalesced.empty() && (drain ||
+                              coalescedCount>=coalesceCount ||
+                              coalescedBytes>=coalesceBytes ||
+                              steadyTimeMS()>=coalesced.oldestMS+coalesceMS))
+    {
+      // Reset the counts before taking the list so that anything counted is also taken.
+      coalescedCount = 0;
+      coalescedBytes = 0;
+      if(auto node = coalesced.takeAll(); node)
+        return node;
+    }
+
+    if(drain || steadyTimeMS()>=lowPriorityNextMS)
+    {
+      if(auto node = takeBatch(worker, GarbagePriority::Low); node)
+      {
+        lowPriority = true;
+        return node;
+      }
+    }
+
+    return nullptr;
+  }
+
+  //################################################################################################
+  void run(Queue_lt::Node* node, bool lowPriority)
+  {
+#ifdef TP_ENABLE_PROFILING
+    int64_t startNS = monotonicTimeNS();
+#endif
+
+    size_t bytes{0};
+    size_t count{0};
+    int64_t maxUS{0};
+    int64_t startUS = steadyTimeUS();
+    int64_t previousUS = startUS;
+    while(node)
+    {
+      node->value.closure();
+      bytes += node->value.sizeBytes;
+      count++;
+      node = Queue_lt::deleteNode(node);
+
+      int64_t nowUS = steadyTimeUS();
+      maxUS = tpMax(maxUS, nowUS-previousUS);
+      previousUS = nowUS;
+    }
+
+    pending -= count;
+    processed += count;
+    processingUS += previousUS-startUS;
+    int64_t max = maxClosureUS;
+    while(maxUS>max && !maxClosureUS.compare_exchange_weak(max, maxUS));
+
+#ifdef TP_ENABLE_PROFILING
+    if(Profiler* p = profiler; p)
+    {
+      static const ProfilerRangeDescriptor descriptor("Garbage", TPPixel(170, 170, 170));
+      p->addRange(descriptor, startNS, monotonicTimeNS());
+      PRF_COUNTER(p, "Garbage pending", size_t(pending));
+    }
+#endif
+
+    // Delay the next low priority batch in proportion to how much was freed.
+    if(size_t bytesPerSecond = lowPriorityBytesPerSecond; lowPriority && bytesPerSecond && !drainAll())
+    {
+      int64_t delayMS = int64_t((bytes*1000) / bytesPerSecond);
+      int64_t now = steadyTimeMS();
+      int64_t next = lowPriorityNextMS;
+      while(!lowPriorityNextMS.compare_exchange_weak(next, tpMax(now, next) + delayMS));
+    }
+  }
+
+  //################################################################################################
+  bool allEmpty() const
+  {
+    for(const auto& q : queues)
+      if(!q.empty())
+        return false;
+    return coalesced.empty();
+  }
+
+  //################################################################################################
+  GarbageStats stats()
+  {
+    GarbageStats stats;
+    stats.pending = pending;
+    stats.processed = processed;
+    stats.processingUS = processingUS;
+    stats.maxClosureUS = maxClosureUS;
+
+    int64_t now = steadyTimeMS();
+    auto age = [&](const Queue_lt& q)
+    {
+      if(!q.empty())
+        stats.oldestPendingMS = tpMax(stats.oldestPendingMS, now-q.oldestMS);
+    };
+
+    for(const auto& q : queues)
+      age(q);
+    age(coalesced);
+
+    TP_MUTEX_LOCKER(mutex);
+    for(const Worker_lt* worker : workers)
+      for(const auto& oldestMS : worker->remainderOldestMS)
+        if(int64_t queuedMS = oldestMS; queuedMS)
+          stats.oldestPendingMS = tpMax(stats.oldestPendingMS, now-queuedMS);
+
+    return stats;
+  }
+
+  //################################################################################################
+  //! Must be called with mutex locked.
   void addThread()
   {
-    threads.push_back(new std::thread([&]
+    if(finish)
+      return;
+
+    for(auto& thread : retired)
+      thread.join();
+    retired.clear();
+
+    nThreads++;
+    auto i = threads.emplace(threads.end());
+    *i = std::thread([this, i]
     {
       lib_platform::setThreadName("Garbage");
-      TPMutexLocker lock(mutex);
-      while(!finish || !queue.empty())
+      Worker_lt worker;
+      mutex.locked(TPMc [&]{workers.push_back(&worker);});
+
+      int64_t idleSinceMS{0};
+      for(;;)
       {
-        if(queue.empty())
-          waitCondition.wait(TPMc lock);
-        else
+        checkMemoryPressure();
+
+        bool lowPriority{false};
+        if(auto node = takeWork(worker, lowPriority); node)
+        {
+          idleSinceMS = 0;
+          run(node, lowPriority);
+          continue;
+        }
+
+        TPMutexLocker lock(mutex);
+        sleeping++;
+        int64_t waitMS = finish?0:runnableInMS(worker);
+
+        // Surplus workers retire once they have been idle for idleMS, the rest park without a
+        // timeout until there is work to do.
+        bool surplus = nThreads>minThreads;
+        if(waitMS==INT64_MAX && surplus)
         {
-          auto closure = queue.front();
-          queue.pop();
+          int64_t now = steadyTimeMS();
+          if(idleSinceMS==0)
+            idleSinceMS = now;
+
+          if(now-idleSinceMS>=idleMS)
           {
-            TP_MUTEX_UNLOCKER(lock);
-            closure();
+            sleeping--;
+            nThreads--;
+            workers.remove(&worker);
+            retired.push_back(std::move(*i));
+            threads.erase(i);
+            return;
           }
+
+          waitMS = idleSinceMS+idleMS-now;
+        }
+        else
+          idleSinceMS = 0;
+
+        if(waitMS>0)
+          waitCondition.wait(TPMc lock, waitMS);
+        sleeping--;
+
+        if(finish && allEmpty() && !worker.hasRemainder())
+        {
+          workers.remove(&worker);
+          return;
         }
       }
-    }));
+    });
   }
 
   //################################################################################################
-  void setThreads(size_t nThreads)
+  void setThreadRange(size_t min, size_t max)
   {
-    while(threads.size()<nThreads)
+    TP_MUTEX_LOCKER(mutex);
+    minThreads = tpMax(size_t(1), min);
+    maxThreads = tpMax(size_t(minThreads), max);
+    while(nThreads<minThreads)
       addThread();
+
+    // Let parked workers that are now surplus start their idle timeout.
+    waitCondition.wakeAll();
   }
 };
 
@@ -75,7 +562,7 @@ Garbage::Garbage():
   });
 #endif
 
-  d->setThreads(4);
+  d->setThreadRange(1, 4);
 }
 
 //##################################################################################################
@@ -86,14 +573,13 @@ Garbage::~Garbage()
   staticState.instanceMutex.locked(TPMc [&]{staticState.instance = nullptr;});
 #endif
 
+  // Once finish is set workers no longer retire or get added, so the lists can be used unlocked.
   d->mutex.locked(TPMc [&]{d->finish = true;});
   d->waitCondition.wakeAll();
-  while(!d->threads.empty())
-  {
-    auto thread = tpTakeLast(d->threads);
-    thread->join();
-    delete thread;
-  }
+  for(auto& thread : d->threads)
+    thread.join();
+  for(auto& thread : d->retired)
+    thread.join();
 
   delete d;
 }
@@ -101,18 +587,80 @@ Garbage::~Garbage()
 //##################################################################################################
 void Garbage::garbage(const std::function<void()>& closure)
 {
-  d->mutex.locked(TPMc [&]{d->queue.push(closure);});
-  d->waitCondition.wakeOne();
+  d->push(closure, smallSizeBytes(), GarbagePriority::Normal);
+}
+
+//##################################################################################################
+void Garbage::garbage(const std::function<void()>& closure, size_t sizeBytes, GarbagePriority priority)
+{
+  d->push(closure, sizeBytes, priority);
 }
 
 //##################################################################################################
 void Garbage::increaseThreads(size_t nThreads)
 {
-  d->setThreads(nThreads);
+  d->setThreadRange(tpMax(size_t(d->minThreads), nThreads), tpMax(size_t(d->maxThreads), nThreads));
 }
 
 //##################################################################################################
-void garbage(const std::function<void()>& closure)
+void Garbage::setThreadRange(size_t minThreads, size_t maxThreads)
+{
+  d->setThreadRange(minThreads, maxThreads);
+}
+
+//##################################################################################################
+size_t Garbage::threadCount() const
+{
+  return d->nThreads;
+}
+
+//##################################################################################################
+void Garbage::setMemoryPressureThreshold(size_t rssBytes)
+{
+  d->memoryPressureThresholdKB = (rssBytes+1023)/1024;
+  if(rssBytes==0)
+    d->memoryPressure = false;
+}
+
+//##################################################################################################
+void Garbage::setLowPriorityBytesPerSecond(size_t bytesPerSecond)
+{
+  d->lowPriorityBytesPerSecond = bytesPerSecond;
+  if(bytesPerSecond==0)
+    d->lowPriorityNextMS = 0;
+}
+
+//##################################################################################################
+bool Garbage::memoryPressure() const
+{
+  return d->memoryPressure;
+}
+
+//##################################################################################################
+GarbageStats Garbage::stats() const
+{
+  return d->stats();
+}
+
+//##################################################################################################
+void Garbage::resetMaxClosure()
+{
+  d->maxClosureUS = 0;
+}
+
+#ifdef TP_ENABLE_PROFILING
+//##################################################################################################
+void Garbage::setProfiler(Profiler* profiler)
+{
+  d->profiler = profiler;
+}
+#endif
+
+namespace
+{
+//##################################################################################################
+template<typename... Args>
+void garbageImpl(const std::function<void()>& closure, Args... args)
 {
 #ifndef TP_NO_THREADS
   auto& staticState = getStaticState();
@@ -120,7 +668,7 @@ void garbage(const std::function<void()>& closure)
     TP_MUTEX_LOCKER(staticState.instanceMutex);
     if(staticState.instance)
     {
-      staticState.instance->garbage(closure);
+      staticState.instance->garbage(closure, args...);
       return;
     }
   }
@@ -128,5 +676,42 @@ void garbage(const std::function<void()>& closure)
 
   closure();
 }
+}
+
+//##################################################################################################
+void garbage(const std::function<void()>& closure)
+{
+  garbageImpl(closure);
+}
+
+//##################################################################################################
+void garbage(const std::function<void()>& closure, size_t sizeBytes, GarbagePriority priority)
+{
+  garbageImpl(closure, sizeBytes, priority);
+}
+
+//##################################################################################################
+GarbageStats garbageStats()
+{
+#ifndef TP_NO_THREADS
+  auto& staticState = getStaticState();
+  TP_MUTEX_LOCKER(staticState.instanceMutex);
+  if(staticState.instance)
+    return staticState.instance->stats();
+#endif
+
+  return GarbageStats();
+}
+
+//##################################################################################################
+void resetGarbageMaxClosure()
+{
+#ifndef TP_NO_THREADS
+  auto& staticState = getStaticState();
+  TP_MUTEX_LOCKER(staticState.instanceMutex);
+  if(staticState.instance)
+    staticState.instance->resetMaxClosure();
+#endif
+}
 
 }
@@ -0,0 +1,384 @@
+#include "tp_utils/MappedProgressStore.h"
+
+#ifdef TP_LINUX
+
+#include "tp_utils/MutexUtils.h"
+#include "tp_utils/DebugUtils.h"
+#include "tp_utils/TimeUtils.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+namespace tp_utils
+{
+
+namespace
+{
+constexpr char recordsMagic[8]{'T','P','P','R','O','G','R','S'};
+constexpr char namesMagic[8]{'T','P','P','R','O','G','N','M'};
+constexpr uint32_t fileVersion{1};
+
+//##################################################################################################
+struct FileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+
+  //! The number of bytes after the header that have been completely written.
+  std::atomic<uint64_t> used;
+
+  //! monotonicToEpochOffsetNS() of the writer, times are from its monotonicTimeNS().
+  int64_t epochOffsetNS;
+};
+
+static_assert(sizeof(FileHeader)==32);
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+//##################################################################################################
+struct Record
+{
+  uint64_t id;
+  uint64_t parentId;
+  int64_t start;
+  int64_t end;
+  uint32_t nameIndex;
+  float fraction;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint8_t a;
+  uint8_t active;
+  uint8_t padding[3];
+  uint64_t threadId;
+};
+
+static_assert(sizeof(Record)==56);
+
+//##################################################################################################
+//! An append only file that is mapped into memory and grows by doubling.
+struct MappedFile
+{
+  int fd{-1};
+  uint8_t* data{nullptr};
+  size_t capacity{0};
+
+  //################################################################################################
+  ~MappedFile()
+  {
+    if(data)
+    {
+      // Trim the file back to what has been written.
+      if(ftruncate(fd, off_t(sizeof(FileHeader)+header()->used))<0)
+        tpWarning() << "Failed to trim progress store: " << std::strerror(errno);
+      munmap(data, capacity);
+    }
+
+    if(fd>=0)
+      ::close(fd);
+  }
+
+  //################################################################################################
+  FileHeader* header() const
+  {
+    return reinterpret_cast<FileHeader*>(data);
+  }
+
+  //################################################################################################
+  bool open(const std::string& path, const char* magic, uint32_t recordSize, size_t initialCapacity)
+  {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd<0)
+    {
+      tpWarning() << "Failed to open progress store: " << path << " " << std::strerror(errno);
+      return false;
+    }
+
+    if(!resize(initialCapacity))
+      return false;
+
+    FileHeader* h = header();
+    std::memcpy(h->magic, magic, sizeof(h->magic));
+    h->version = fileVersion;
+    h->recordSize = recordSize;
+    h->epochOffsetNS = monotonicToEpochOffsetNS();
+    h->used.store(0, std::memory_order_release);
+    return true;
+  }
+
+  //################################################################################################
+  bool resize(size_t newCapacity)
+  {
+    if(ftruncate(fd, off_t(newCapacity))<0)
+    {
+      tpWarning() << "Failed to grow progress store: " << std::strerror(errno);
+      return false;
+    }
+
+    void* newData = data?
+          mremap(data, capacity, newCapacity, MREMAP_MAYMOVE):
+          mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(newData==MAP_FAILED)
+    {
+      tpWarning() << "Failed to map progress store: " << std::strerror(errno);
+      return false;
+    }
+
+    data = static_cast<uint8_t*>(newData);
+    capacity = newCapacity;
+    return true;
+  }
+
+  //################################################################################################
+  //! Append the bytes and then publish them by advancing the used count.
+  bool append(const void* bytes, size_t size)
+  {
+    if(!data)
+      return false;
+
+    size_t used = size_t(header()->used.load(std::memory_order_relaxed));
+    size_t required = sizeof(FileHeader) + used + size;
+    if(required>capacity)
+    {
+      size_t newCapacity = capacity*2;
+      while(newCapacity<required)
+        newCapacity*=2;
+
+      if(!resize(newCapacity))
+        return false;
+    }
+
+    std::memcpy(data + sizeof(FileHeader) + used, bytes, size);
+    header()->used.store(uint64_t(used+size), std::memory_order_release);
+    return true;
+  }
+};
+
+//##################################################################################################
+//! Read the published part of a file written by MappedFile.
+std::string readPublished(const std::string& path, const char* magic, uint32_t recordSize, int64_t& epochOffsetNS)
+{
+  std::ifstream in(path, std::ios::binary);
+  if(!in)
+    return std::string();
+
+  char magic_[8]{};
+  uint32_t version{0};
+  uint32_t recordSize_{0};
+  uint64_t used{0};
+  in.read(magic_, sizeof(magic_));
+  in.read(reinterpret_cast<char*>(&version), sizeof(version));
+  in.read(reinterpret_cast<char*>(&recordSize_), sizeof(recordSize_));
+  in.read(reinterpret_cast<char*>(&used), sizeof(used));
+  in.read(reinterpret_cast<char*>(&epochOffsetNS), sizeof(epochOffsetNS));
+
+  if(!in || std::memcmp(magic_, magic, sizeof(magic_))!=0 || version!=fileVersion || recordSize_!=recordSize)
+  {
+    tpWarning() << "Not a progress store file: " << path;
+    return std::string();
+  }
+
+  std::string result(size_t(used), '\0');
+  in.read(result.data(), std::streamsize(used));
+  result.resize(size_t(in.gcount()));
+  return result;
+}
+}
+
+//##################################################################################################
+struct MappedProgressStore::Private
+{
+  TPMutex mutex{TPM};
+  MappedFile records;
+  MappedFile names;
+  bool ok{false};
+
+  std::unordered_map<std::string, uint32_t> nameIndexes;
+  uint64_t nextID{1};
+
+  //################################################################################################
+  Private(const std::string& path)
+  {
+    ok = records.open(path, recordsMagic, sizeof(Record), sizeof(FileHeader) + 1024*sizeof(Record)) &&
+         names.open(path + ".names", namesMagic, 0, 64*1024);
+  }
+
+  //################################################################################################
+  //! Returns the index of name in the side table, adding it if this is the first time it has been seen.
+  bool nameIndex(const std::string& name, uint32_t& index)
+  {
+    if(auto i=nameIndexes.find(name); i!=nameIndexes.end())
+    {
+      index = i->second;
+      return true;
+    }
+
+    // The name is written before any record that refers to it.
+    uint32_t length = uint32_t(name.size());
+    if(!names.append(&length, sizeof(length)) || !names.append(name.data(), name.size()))
+      return false;
+
+    index = uint32_t(nameIndexes.size());
+    nameIndexes.emplace(name, index);
+    return true;
+  }
+
+  //################################################################################################
+  void append(const ProgressEvent& progressEvent)
+  {
+    if(!ok)
+      return;
+
+    Record record{};
+    if(!nameIndex(progressEvent.name, record.nameIndex))
+    {
+      ok = false;
+      return;
+    }
+
+    record.id = progressEvent.id;
+    record.parentId = progressEvent.parentId;
+    record.start = progressEvent.start;
+    record.end = progressEvent.end;
+    record.fraction = progressEvent.fraction;
+    record.r = progressEvent.color.r;
+    record.g = progressEvent.color.g;
+    record.b = progressEvent.color.b;
+    record.a = progressEvent.color.a;
+    record.active = progressEvent.active?1:0;
+    record.threadId = progressEvent.threadId;
+
+    if(!records.append(&record, sizeof(Record)))
+      ok = false;
+  }
+};
+
+//##################################################################################################
+MappedProgressStore::MappedProgressStore(const std::string& path):
+  d(new Private(path))
+{
+
+}
+
+//##################################################################################################
+MappedProgressStore::~MappedProgressStore()
+{
+  delete d;
+}
+
+//##################################################################################################
+void MappedProgressStore::initProgressEvent(ProgressEvent& progressEvent)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  progressEvent.store = this;
+  progressEvent.id = size_t(d->nextID++);
+  d->append(progressEvent);
+}
+
+//##################################################################################################
+void MappedProgressStore::updateProgressEvent(const ProgressEvent& progressEvent)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  assert(progressEvent.store == this);
+  d->append(progressEvent);
+}
+
+//##################################################################################################
+void MappedProgressStore::flush()
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  for(MappedFile* file : {&d->names, &d->records})
+    if(file->data)
+      msync(file->data, file->capacity, MS_SYNC);
+}
+
+//##################################################################################################
+std::vector<ProgressEvent> MappedProgressStore::loadFile(const std::string& path)
+{
+  std::vector<ProgressEvent> progressEvents;
+
+  // Read the records first so that every name they refer to has already been published.
+  int64_t epochOffsetNS{0};
+  int64_t namesEpochOffsetNS{0};
+  std::string recordBytes = readPublished(path, recordsMagic, sizeof(Record), epochOffsetNS);
+  std::string nameBytes = readPublished(path + ".names", namesMagic, 0, namesEpochOffsetNS);
+
+  // Move times from the writer's monotonic clock to this process's.
+  int64_t shiftNS = epochOffsetNS - monotonicToEpochOffsetNS();
+
+  std::vector<std::string> names;
+  for(size_t offset=0; offset+sizeof(uint32_t)<=nameBytes.size();)
+  {
+    uint32_t length{0};
+    std::memcpy(&length, nameBytes.data()+offset, sizeof(length));
+    offset+=sizeof(length);
+    if(offset+length>nameBytes.size())
+      break;
+    names.emplace_back(nameBytes.data()+offset, length);
+    offset+=length;
+  }
+
+  {
+    ProgressEvent& progressEvent = progressEvents.emplace_back();
+    progressEvent.id = 0;
+    progressEvent.name = "Root";
+  }
+
+  size_t count = recordBytes.size()/sizeof(Record);
+  size_t corrupt{0};
+  for(size_t i=0; i<count; i++)
+  {
+    Record record;
+    std::memcpy(&record, recordBytes.data()+i*sizeof(Record), sizeof(Record));
+    if(record.id==0)
+      continue;
+
+    // Each id is written at least once so no valid id can be more than the number of records.
+    if(record.id>count)
+    {
+      corrupt++;
+      continue;
+    }
+
+    // Ids are allocated sequentially so the events can be indexed by id.
+    if(record.id>=progressEvents.size())
+      progressEvents.resize(size_t(record.id)+1);
+
+    ProgressEvent& progressEvent = progressEvents[size_t(record.id)];
+    progressEvent.id = size_t(record.id);
+    progressEvent.parentId = size_t(record.parentId);
+    progressEvent.name = (record.nameIndex<names.size())?names.at(record.nameIndex):std::string();
+    progressEvent.start = record.start+shiftNS;
+    progressEvent.end = record.end+shiftNS;
+    progressEvent.fraction = record.fraction;
+    progressEvent.color = TPPixel(record.r, record.g, record.b, record.a);
+    progressEvent.active = record.active!=0;
+    progressEvent.threadId = record.threadId;
+  }
+
+  if(corrupt)
+    tpWarning() << "Skipped " << corrupt << " progress store records with invalid ids: " << path;
+
+  ProgressEvent& root = progressEvents.front();
+  for(const auto& progressEvent : progressEvents)
+  {
+    if(progressEvent.start!=0 && (root.start==0 || progressEvent.start<root.start))
+      root.start = progressEvent.start;
+    root.end = tpMax(root.end, progressEvent.end);
+  }
+
+  return progressEvents;
+}
+
+}
+
+#endif
@@ -60,35 +60,39 @@ TPWaitCondition::~TPWaitCondition()
   delete d;
 }
 
-//##################################################################################################
 #ifdef TP_ENABLE_MUTEX_TIME
-bool TPWaitCondition::wait(TPM_Ac TPMutexLocker& lockedMutex, int64_t ms) noexcept
+namespace
+{
+//##################################################################################################
+struct MutexW
 {
-  struct MutexW
+  const char* m_file_tpm;
+  int m_line_tpm;
+  TPMutex& m_lockedMutex;
+
+  MutexW(const char* file_tpm, int line_tpm, TPMutex& lockedMutex):
+    m_file_tpm(file_tpm),
+    m_line_tpm(line_tpm),
+    m_lockedMutex(lockedMutex)
   {
-    const char* m_file_tpm;
-    int m_line_tpm;
-    TPMutex& m_lockedMutex;
-
-    MutexW(const char* file_tpm, int line_tpm, TPMutex& lockedMutex):
-      m_file_tpm(file_tpm),
-      m_line_tpm(line_tpm),
-      m_lockedMutex(lockedMutex)
-    {
 
-    }
+  }
 
-    void lock()
-    {
-      m_lockedMutex.lock(m_file_tpm, m_line_tpm);
-    }
+  void lock()
+  {
+    m_lockedMutex.lock(m_file_tpm, m_line_tpm);
+  }
 
-    void unlock()
-    {
-      m_lockedMutex.unlock(m_file_tpm, m_line_tpm);
-    }
-  };
+  void unlock()
+  {
+    m_lockedMutex.unlock(m_file_tpm, m_line_tpm);
+  }
+};
+}
 
+//##################################################################################################
+bool TPWaitCondition::wait(TPM_Ac TPMutexLocker& lockedMutex, int64_t ms) noexcept
+{
   MutexW mutexW(TPM_Bc *lockedMutex.mutex());
 
   if(ms<INT64_MAX)
@@ -98,7 +102,21 @@ bool TPWaitCondition::wait(TPM_Ac TPMutexLocker& lockedMutex, int64_t ms) noexce
 
   return true;
 }
+
+//##################################################################################################
+bool TPWaitCondition::waitUS(TPM_Ac TPMutexLocker& lockedMutex, int64_t us) noexcept
+{
+  MutexW mutexW(TPM_Bc *lockedMutex.mutex());
+
+  if(us<INT64_MAX)
+    return d->cv.wait_for(mutexW, std::chrono::microseconds(us)) == std::cv_status::no_timeout;
+  else
+    d->cv.wait(mutexW);
+
+  return true;
+}
 #else
+//##################################################################################################
 bool TPWaitCondition::wait(TPMutexLocker& lockedMutex, int64_t ms) noexcept
 {
   if(ms<INT64_MAX)
@@ -107,6 +125,16 @@ bool TPWaitCondition::wait(TPMutexLocker& lockedMutex, int64_t ms) noexcept
   d->cv.wait(lockedMutex);
   return true;
 }
+
+//##################################################################################################
+bool TPWaitCondition::waitUS(TPMutexLocker& lockedMutex, int64_t us) noexcept
+{
+  if(us<INT64_MAX)
+    return d->cv.wait_for(lockedMutex, std::chrono::microseconds(us)) == std::cv_status::no_timeout;
+
+  d->cv.wait(lockedMutex);
+  return true;
+}
 #endif
 
 //##################################################################################################
@@ -2,33 +2,408 @@
 
 #include "tp_utils/Profiler.h"
 #include "tp_utils/Progress.h"
+#include "tp_utils/ChromeTrace.h"
 #include "tp_utils/TimeUtils.h"
 #include "tp_utils/ProfilerController.h"
+#include "tp_utils/MutexUtils.h"
 
 #include "tp_utils/DebugUtils.h"
 
 #include <memory>
 #include <sstream>
-#include <stack>
+#include <array>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
 
 namespace tp_utils
 {
 
+namespace
+{
+//##################################################################################################
+//! A small id for the calling thread, these are never reused so they make stable track ids.
+uint64_t currentThreadID()
+{
+  static std::atomic<uint64_t> nextThreadID{1};
+  thread_local uint64_t threadID{nextThreadID++};
+  return threadID;
+}
+
+//##################################################################################################
+//! A range as it is recorded, names and colors are held by the descriptor.
+struct Range
+{
+  const ProfilerRangeDescriptor* descriptor;
+  int64_t start;
+  int64_t end;
+  size_t localID;
+  size_t parentLocalID;
+};
+
+//##################################################################################################
+//! A counter value as it is recorded, the name is held by the descriptor.
+struct CounterSample
+{
+  const ProfilerCounterDescriptor* descriptor;
+  int64_t time;
+  double value;
+};
+
+//##################################################################################################
+//! An append only list written by one thread that can be read by others while it grows.
+/*!
+Items are appended to fixed size chunks and published by advancing count, so a snapshot can read
+everything below count without stopping the owner.
+*/
+template<typename T>
+struct ChunkedBuffer
+{
+  static constexpr size_t chunkSize{256};
+
+  //################################################################################################
+  struct Chunk
+  {
+    std::array<T, chunkSize> items;
+    std::unique_ptr<Chunk> next;
+  };
+
+  std::unique_ptr<Chunk> head;
+  Chunk* tail{nullptr};
+  std::atomic<size_t> count{0};
+
+  //################################################################################################
+  //! Chunks are allocated on the first append, so an unused buffer costs nothing.
+  void reset()
+  {
+    count.store(0, std::memory_order_release);
+
+    // Free long chains one at a time rather than recursively.
+    while(head)
+      head = std::move(head->next);
+    tail = nullptr;
+  }
+
+  //################################################################################################
+  void append(const T& item)
+  {
+    size_t c = count.load(std::memory_order_relaxed);
+    if(!tail)
+    {
+      head = std::make_unique<Chunk>();
+      tail = head.get();
+    }
+    else if(c && (c%chunkSize)==0)
+    {
+      tail->next = std::make_unique<Chunk>();
+      tail = tail->next.get();
+    }
+
+    tail->items[c%chunkSize] = item;
+    count.store(c+1, std::memory_order_release);
+  }
+
+  //################################################################################################
+  template<typename F>
+  void view(const F& closure) const
+  {
+    size_t c = count.load(std::memory_order_acquire);
+    const Chunk* chunk = head.get();
+    for(size_t i=0; i<c; i++)
+    {
+      if(i && (i%chunkSize)==0)
+        chunk = chunk->next.get();
+      closure(chunk->items[i%chunkSize]);
+    }
+  }
+};
+
+//##################################################################################################
+//! Completed ranges and counter samples recorded by a single thread.
+struct ThreadBuffer
+{
+  uint64_t threadID{0};
+
+  //! The recording that this buffer belongs to, a stale buffer is reset by its owner before use.
+  uint64_t generation{0};
+
+  //! Set when the owning thread exits, the buffer is freed once it no longer holds current data.
+  std::atomic_bool exited{false};
+
+  // Owner only.
+  std::vector<Range> stack;
+  size_t nextLocalID{1};
+
+  //! Descriptors for labels that were passed as strings, these live as long as the buffer.
+  std::unordered_map<std::string, std::vector<std::unique_ptr<ProfilerRangeDescriptor>>> interned;
+  std::unordered_map<std::string, std::unique_ptr<ProfilerCounterDescriptor>> internedCounters;
+
+  ChunkedBuffer<Range> ranges;
+  ChunkedBuffer<CounterSample> counters;
+
+  //################################################################################################
+  void reset(uint64_t generation_)
+  {
+    generation = generation_;
+    stack.clear();
+    nextLocalID = 1;
+    ranges.reset();
+    counters.reset();
+
+    // Nothing refers to the descriptors once the ranges and counters have gone.
+    interned.clear();
+    internedCounters.clear();
+  }
+
+  //################################################################################################
+  //! Open a range, owner only.
+  void push(const ProfilerRangeDescriptor* descriptor)
+  {
+    size_t parentLocalID = stack.empty()?0:stack.back().localID;
+    int64_t start = monotonicTimeNS();
+    stack.push_back({descriptor, start, start, nextLocalID++, parentLocalID});
+  }
+
+  //################################################################################################
+  //! Returns a descriptor for a label that is not known at compile time, owner only.
+  const ProfilerRangeDescriptor* intern(const std::string& label, TPPixel color)
+  {
+    auto& descriptors = interned[label];
+    for(const auto& descriptor : descriptors)
+      if(descriptor->color.i == color.i)
+        return descriptor.get();
+
+    return descriptors.emplace_back(std::make_unique<ProfilerRangeDescriptor>(StringID(label), color)).get();
+  }
+
+  //################################################################################################
+  //! Returns a descriptor for a counter name that is not known at compile time, owner only.
+  const ProfilerCounterDescriptor* internCounter(const std::string& name)
+  {
+    auto& descriptor = internedCounters[name];
+    if(!descriptor)
+      descriptor = std::make_unique<ProfilerCounterDescriptor>(StringID(name));
+    return descriptor.get();
+  }
+};
+
+//##################################################################################################
+//! Marks the calling thread's buffers as exited when the thread ends.
+void registerThreadBuffer(const std::shared_ptr<ThreadBuffer>& buffer)
+{
+  struct ThreadExit_lt
+  {
+    std::vector<std::weak_ptr<ThreadBuffer>> buffers;
+
+    ~ThreadExit_lt()
+    {
+      for(const auto& buffer : buffers)
+        if(auto b = buffer.lock(); b)
+          b->exited = true;
+    }
+  };
+
+  thread_local ThreadExit_lt threadExit;
+
+  // Drop buffers from profilers that have been deleted.
+  auto& buffers = threadExit.buffers;
+  buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](const auto& b){return b.expired();}), buffers.end());
+  buffers.push_back(buffer);
+}
+}
+
 //##################################################################################################
 struct Profiler::Private
 {
   ProfilerController* controller;
   std::string name;
-  std::unique_ptr<RAMProgressStore> progressStore{std::make_unique<RAMProgressStore>()};
 
-  bool recording{false};
+  //! A unique id used to find this profiler's buffer in the thread local cache.
+  const uint64_t serial;
+
+  std::atomic_bool recording{false};
+  std::atomic<uint64_t> generation{1};
+  int64_t recordingStart{monotonicTimeNS()};
+
+  // Protects the list of buffers and resetting a buffer while a snapshot is being taken.
+  TPMutex buffersMutex{TPM};
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
 
   std::vector<SummaryGenerator> summaryGenerators;
-  std::stack<tp_utils::ProgressEvent> eventStack;
 
+  //################################################################################################
   Private(ProfilerController* controller_):
-    controller(controller_)
+    controller(controller_),
+    serial(nextSerial())
+  {
+  }
+
+  //################################################################################################
+  static uint64_t nextSerial()
+  {
+    static std::atomic<uint64_t> serial{0};
+    return ++serial;
+  }
+
+  //################################################################################################
+  //! Returns the calling thread's buffer, ready to record into.
+  ThreadBuffer* threadBuffer()
+  {
+    struct CacheEntry_lt
+    {
+      uint64_t serial{0};
+      ThreadBuffer* buffer{nullptr};
+    };
+
+    // Most threads only record into one or two profilers.
+    thread_local std::array<CacheEntry_lt, 4> cache;
+    thread_local size_t nextCacheEntry{0};
+
+    ThreadBuffer* buffer = nullptr;
+    for(const auto& entry : cache)
+    {
+      if(entry.serial == serial)
+      {
+        buffer = entry.buffer;
+        break;
+      }
+    }
+
+    if(!buffer)
+    {
+      uint64_t threadID = currentThreadID();
+      TP_MUTEX_LOCKER(buffersMutex);
+      for(const auto& b : buffers)
+        if(b->threadID == threadID)
+          buffer = b.get();
+
+      if(!buffer)
+      {
+        const auto& b = buffers.emplace_back(std::make_shared<ThreadBuffer>());
+        b->threadID = threadID;
+        b->reset(generation);
+        registerThreadBuffer(b);
+        buffer = b.get();
+      }
+
+      auto& entry = cache.at(nextCacheEntry++ % cache.size());
+      entry.serial = serial;
+      entry.buffer = buffer;
+    }
+
+    if(uint64_t g = generation.load(std::memory_order_acquire); buffer->generation != g)
+    {
+      TP_MUTEX_LOCKER(buffersMutex);
+      buffer->reset(g);
+    }
+
+    return buffer;
+  }
+
+  //################################################################################################
+  //! Free buffers from threads that have exited and hold nothing from this recording, requires buffersMutex.
+  /*!
+  Buffers of live threads can't be freed here because their owners write to them without locking,
+  a stale buffer is reset by its owner on its next use instead.
+  */
+  void releaseExitedBuffers()
+  {
+    uint64_t g = generation;
+    buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [&](const auto& b)
+    {
+      return b->exited && b->generation != g;
+    }), buffers.end());
+  }
+
+  //################################################################################################
+  //! Merge the completed ranges from each thread into a single list with sequential ids.
+  std::vector<ProgressEvent> snapshot()
+  {
+    std::vector<ProgressEvent> progressEvents;
+
+    {
+      TP_MUTEX_LOCKER(buffersMutex);
+      releaseExitedBuffers();
+
+      ProgressEvent& root = progressEvents.emplace_back();
+      root.id = 0;
+      root.name = "Root";
+      root.start = recordingStart;
+      root.end = monotonicTimeNS();
+
+      uint64_t g = generation;
+      for(const auto& buffer : buffers)
+      {
+        if(buffer->generation != g)
+          continue;
+
+        buffer->ranges.view([&](const Range& range)
+        {
+          ProgressEvent& progressEvent = progressEvents.emplace_back();
+          progressEvent.id = range.localID;
+          progressEvent.parentId = range.parentLocalID;
+          progressEvent.threadId = buffer->threadID;
+          progressEvent.name = range.descriptor->name;
+          progressEvent.start = range.start;
+          progressEvent.end = range.end;
+          progressEvent.color = range.descriptor->color;
+          progressEvent.active = false;
+        });
+      }
+    }
+
+    // Order by start time and renumber, parents that are still open are replaced by the root.
+    std::stable_sort(progressEvents.begin()+1, progressEvents.end(), [](const auto& a, const auto& b)
+    {
+      return a.start<b.start;
+    });
+
+    // Maps (thread, local id) to the index in progressEvents.
+    std::unordered_map<uint64_t, std::unordered_map<size_t, size_t>> ids;
+    for(size_t i=1; i<progressEvents.size(); i++)
+      ids[progressEvents[i].threadId][progressEvents[i].id] = i;
+
+    for(size_t i=1; i<progressEvents.size(); i++)
+    {
+      ProgressEvent& progressEvent = progressEvents[i];
+      const auto& threadIDs = ids[progressEvent.threadId];
+      auto parent = threadIDs.find(progressEvent.parentId);
+      progressEvent.parentId = (progressEvent.parentId && parent!=threadIDs.end())?parent->second:0;
+    }
+
+    for(size_t i=1; i<progressEvents.size(); i++)
+      progressEvents[i].id = i;
+
+    return progressEvents;
+  }
+
+  //################################################################################################
+  //! Merge the counter samples from each thread into a single list ordered by time.
+  std::vector<ProfilerCounterSample> counterSnapshot()
   {
+    std::vector<ProfilerCounterSample> samples;
+
+    {
+      TP_MUTEX_LOCKER(buffersMutex);
+      uint64_t g = generation;
+      for(const auto& buffer : buffers)
+      {
+        if(buffer->generation != g)
+          continue;
+
+        buffer->counters.view([&](const CounterSample& counterSample)
+        {
+          samples.push_back({counterSample.descriptor->name, counterSample.time, counterSample.value, buffer->threadID});
+        });
+      }
+    }
+
+    std::stable_sort(samples.begin(), samples.end(), [](const auto& a, const auto& b)
+    {
+      return a.time<b.time;
+    });
+
+    return samples;
   }
 };
 
@@ -106,43 +481,91 @@ void Profiler::setName(const std::string& name)
 }
 
 //##################################################################################################
-void Profiler::rangePush(const std::string& label, TPPixel color)
+void Profiler::rangePush(const ProfilerRangeDescriptor& descriptor)
 {
-  if(!d->recording)
+  if(!d->recording.load(std::memory_order_relaxed))
     return;
 
-  size_t parentId = 0;
-  if(!d->eventStack.empty())
-    parentId = d->eventStack.top().id;
+  d->threadBuffer()->push(&descriptor);
+}
+
+//##################################################################################################
+void Profiler::rangePush(const std::string& label, TPPixel color)
+{
+  if(!d->recording.load(std::memory_order_relaxed))
+    return;
 
-  auto& progressEvent = d->eventStack.emplace();
-  progressEvent.parentId = parentId;
-  progressEvent.name = label;
-  progressEvent.start = tp_utils::currentTimeMS();
-  progressEvent.end = tp_utils::currentTimeMS();
-  progressEvent.active = true;
-  progressEvent.color = color;
-  d->progressStore->initProgressEvent(progressEvent);
+  ThreadBuffer* buffer = d->threadBuffer();
+  buffer->push(buffer->intern(label, color));
 }
 
 //##################################################################################################
 void Profiler::rangePop()
 {
-  if(!d->recording)
+  if(!d->recording.load(std::memory_order_relaxed))
+    return;
+
+  ThreadBuffer* buffer = d->threadBuffer();
+
+  // The stack is cleared when recording restarts.
+  if(buffer->stack.empty())
+    return;
+
+  Range& range = buffer->stack.back();
+  range.end = monotonicTimeNS();
+  buffer->ranges.append(range);
+  buffer->stack.pop_back();
+}
+
+//##################################################################################################
+void Profiler::addRange(const ProfilerRangeDescriptor& descriptor, int64_t start, int64_t end)
+{
+  if(!d->recording.load(std::memory_order_relaxed))
+    return;
+
+  ThreadBuffer* buffer = d->threadBuffer();
+  buffer->ranges.append({&descriptor, start, end, buffer->nextLocalID++, 0});
+}
+
+//##################################################################################################
+void Profiler::addRange(const std::string& label, TPPixel color, int64_t start, int64_t end)
+{
+  if(!d->recording.load(std::memory_order_relaxed))
     return;
 
-  auto& progressEvent = d->eventStack.top();
-  progressEvent.end = tp_utils::currentTimeMS();
-  progressEvent.active = false;
+  ThreadBuffer* buffer = d->threadBuffer();
+  buffer->ranges.append({buffer->intern(label, color), start, end, buffer->nextLocalID++, 0});
+}
+
+//##################################################################################################
+void Profiler::counter(const ProfilerCounterDescriptor& descriptor, double value)
+{
+  if(!d->recording.load(std::memory_order_relaxed))
+    return;
+
+  d->threadBuffer()->counters.append({&descriptor, monotonicTimeNS(), value});
+}
+
+//##################################################################################################
+void Profiler::counter(const std::string& name, double value)
+{
+  if(!d->recording.load(std::memory_order_relaxed))
+    return;
 
-  d->progressStore->updateProgressEvent(progressEvent);
-  d->eventStack.pop();
+  ThreadBuffer* buffer = d->threadBuffer();
+  buffer->counters.append({buffer->internCounter(name), monotonicTimeNS(), value});
 }
 
 //##################################################################################################
 void Profiler::viewProgressEvents(const std::function<void(const std::vector<ProgressEvent>&)>& closure) const
 {
-  d->progressStore->viewProgressEvents(closure);
+  closure(d->snapshot());
+}
+
+//##################################################################################################
+void Profiler::viewCounterSamples(const std::function<void(const std::vector<ProfilerCounterSample>&)>& closure) const
+{
+  closure(d->counterSnapshot());
 }
 
 //##################################################################################################
@@ -169,7 +592,13 @@ void Profiler::clearSummaryGenerators()
 //##################################################################################################
 void Profiler::startRecording()
 {
-  d->progressStore.reset(new RAMProgressStore());
+  // Buffers belonging to the previous recording are reset by their threads on their next use.
+  d->buffersMutex.locked(TPMc [&]
+  {
+    d->generation++;
+    d->recordingStart = monotonicTimeNS();
+    d->releaseExitedBuffers();
+  });
   d->recording = true;
   d->controller->changed();
 }
@@ -187,7 +616,45 @@ void Profiler::stopRecording()
 //##################################################################################################
 void Profiler::saveState(nlohmann::json& j) const
 {
-  d->progressStore->saveState(j);
+  std::vector<ProgressEvent> progressEvents = d->snapshot();
+
+  j = nlohmann::json::array();
+  j.get_ptr<nlohmann::json::array_t*>()->reserve(progressEvents.size());
+  for(const auto& progressEvent : progressEvents)
+  {
+    j.emplace_back();
+    progressEvent.saveState(j.back());
+  }
+}
+
+//##################################################################################################
+void Profiler::saveCountersState(nlohmann::json& j) const
+{
+  std::vector<ProfilerCounterSample> samples = d->counterSnapshot();
+
+  // One series per counter, times and values are stored as parallel arrays.
+  j = nlohmann::json::object();
+  for(const auto& sample : samples)
+  {
+    nlohmann::json& series = j[sample.name];
+    series["timeNS"].push_back(sample.time);
+    series["value"].push_back(sample.value);
+  }
+}
+
+//##################################################################################################
+void Profiler::saveChromeTrace(ChromeTraceWriter& writer) const
+{
+  viewProgressEvents([&](const std::vector<ProgressEvent>& progressEvents)
+  {
+    writer.addProgressEvents(progressEvents, d->name.empty()?id.toString():d->name);
+  });
+
+  viewCounterSamples([&](const std::vector<ProfilerCounterSample>& samples)
+  {
+    for(const auto& sample : samples)
+      writer.addCounter(sample.name, sample.time, sample.value);
+  });
 }
 
 //##################################################################################################
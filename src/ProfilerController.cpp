@@ -2,6 +2,7 @@
 
 #include "tp_utils/ProfilerController.h"
 #include "tp_utils/Profiler.h"
+#include "tp_utils/SamplingProfiler.h"
 
 #include <unordered_map>
 
@@ -22,6 +23,10 @@ struct ProfilerController::Private
 {
   std::vector<std::weak_ptr<Profiler>> profilers;
 
+#ifdef TP_LINUX
+  std::unique_ptr<SamplingProfiler> samplingProfiler;
+#endif
+
   //################################################################################################
   template<typename T>
   void iterateProfilers(const T& closure)
@@ -49,6 +54,9 @@ ProfilerController::ProfilerController():
 //##################################################################################################
 ProfilerController::~ProfilerController()
 {
+#ifdef TP_LINUX
+  d->samplingProfiler.reset();
+#endif
   delete d;
 }
 
@@ -93,6 +101,16 @@ std::shared_ptr<Profiler> ProfilerController::profiler(const StringID& id)
   return profiler;
 }
 
+#ifdef TP_LINUX
+//##################################################################################################
+SamplingProfiler* ProfilerController::samplingProfiler()
+{
+  if(!d->samplingProfiler)
+    d->samplingProfiler.reset(new SamplingProfiler(this));
+  return d->samplingProfiler.get();
+}
+#endif
+
 //##################################################################################################
 void ProfilerController::profilerDeleted(Profiler* profiler)
 {
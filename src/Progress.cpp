@@ -4,18 +4,27 @@
 #include "tp_utils/RefCount.h"
 #include "tp_utils/AbstractCrossThreadCallback.h"
 #include "tp_utils/TimeUtils.h"
+#include "tp_utils/TimerService.h"
 #include "tp_utils/JSONUtils.h"
 #include "tp_utils/detail/log_stats/virtual_memory.h"
 
 #include "lib_platform/Format.h"
 
 #include <optional>
+#include <atomic>
+#include <chrono>
 
 namespace tp_utils
 {
 
 namespace
 {
+//##################################################################################################
+int64_t steadyTimeUS()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //##################################################################################################
 struct ChildStep_lt
 {
@@ -33,10 +42,15 @@ void ProgressEvent::saveState(nlohmann::json& j) const
 {
   j["id"] = id;
   j["parentId"] = parentId;
+  if(threadId)
+    j["threadId"] = threadId;
   j["name"] = name;
 
-  j["start"] = start;
-  j["end"] = (end==0)?currentTimeMS():end;
+  int64_t endNS = (end==0)?monotonicTimeNS():end;
+  j["start"] = monotonicNSToTimeMS(start);
+  j["end"] = monotonicNSToTimeMS(endNS);
+  j["startEpochNS"] = start + monotonicToEpochOffsetNS();
+  j["endEpochNS"] = endNS + monotonicToEpochOffsetNS();
   j["fraction"] = fraction;
   j["color"] = color.toString();
   j["active"] = false;
@@ -47,10 +61,20 @@ void ProgressEvent::loadState(const nlohmann::json& j)
 {
   id = TPJSONSizeT(j, "id");
   parentId = TPJSONSizeT(j, "parentId");
+  threadId = TPJSONUint64T(j, "threadId");
   name = TPJSONString(j, "name");
 
-  start = TPJSONInt64T(j, "start");
-  end = TPJSONInt64T(j, "end");
+  if(j.contains("startEpochNS"))
+  {
+    start = TPJSONInt64T(j, "startEpochNS") - monotonicToEpochOffsetNS();
+    end = TPJSONInt64T(j, "endEpochNS") - monotonicToEpochOffsetNS();
+  }
+  else
+  {
+    // Older files only have ms since the epoch that can be trusted.
+    start = timeMSToMonotonicNS(TPJSONInt64T(j, "start"));
+    end = timeMSToMonotonicNS(TPJSONInt64T(j, "end"));
+  }
   fraction = TPJSONFloat(j, "fraction");
   color = TPPixel(TPJSONString(j, "color"));
   active = TPJSONBool(j, "active");
@@ -77,8 +101,8 @@ RAMProgressStore::RAMProgressStore():
   progressEvent.store = this;
   progressEvent.id = 0;
   progressEvent.name = "Root";
-  progressEvent.start = currentTimeMS();
-  progressEvent.end = currentTimeMS();
+  progressEvent.start = monotonicTimeNS();
+  progressEvent.end = progressEvent.start;
 }
 
 //##################################################################################################
@@ -143,6 +167,165 @@ std::vector<ProgressEvent> RAMProgressStore::loadState(const nlohmann::json& j)
   return progressEvents;
 }
 
+//##################################################################################################
+struct RingProgressStore::Private
+{
+  //################################################################################################
+  struct Record
+  {
+    size_t id{0};
+    size_t parentId{0};
+    uint64_t threadId{0};
+    StringID name;
+    int64_t start{0};
+    int64_t end{0};
+    float fraction{0.0f};
+    TPPixel color;
+    bool active{false};
+  };
+
+  RingProgressStore* q;
+  TPMutex mutex{TPM};
+  ProgressEvent root;
+  std::vector<Record> records;
+
+  //! The id that will be given to the next event, ids start at 1 as 0 is the root event.
+  size_t nextID{1};
+
+  //################################################################################################
+  Private(RingProgressStore* q_, size_t capacity):
+    q(q_),
+    records(tpMax(capacity, size_t(1)))
+  {
+    root.store = q;
+    root.id = 0;
+    root.name = "Root";
+    root.start = monotonicTimeNS();
+    root.end = root.start;
+  }
+
+  //################################################################################################
+  //! Returns the record for id or nullptr if it has been dropped, requires mutex.
+  Record* record(size_t id)
+  {
+    if(id==0 || id>=nextID || nextID-id>records.size())
+      return nullptr;
+    return &records[id%records.size()];
+  }
+
+  //################################################################################################
+  static void copy(const ProgressEvent& src, Record& dst)
+  {
+    dst.parentId = src.parentId;
+    dst.threadId = src.threadId;
+    if(dst.name.toString() != src.name)
+      dst.name = src.name;
+    dst.start = src.start;
+    dst.end = src.end;
+    dst.fraction = src.fraction;
+    dst.color = src.color;
+    dst.active = src.active;
+  }
+
+  //################################################################################################
+  //! Expand the retained records into events oldest first, requires mutex.
+  std::vector<ProgressEvent> progressEvents() const
+  {
+    std::vector<ProgressEvent> progressEvents;
+    size_t first = (nextID>records.size())?(nextID-records.size()):1;
+    progressEvents.reserve(nextID-first+1);
+    progressEvents.push_back(root);
+
+    for(size_t id=first; id<nextID; id++)
+    {
+      const Record& record = records[id%records.size()];
+      ProgressEvent& progressEvent = progressEvents.emplace_back();
+      progressEvent.store = q;
+      progressEvent.id = record.id;
+      progressEvent.parentId = record.parentId;
+      progressEvent.threadId = record.threadId;
+      progressEvent.name = record.name.toString();
+      progressEvent.start = record.start;
+      progressEvent.end = record.end;
+      progressEvent.fraction = record.fraction;
+      progressEvent.color = record.color;
+      progressEvent.active = record.active;
+    }
+
+    return progressEvents;
+  }
+};
+
+//##################################################################################################
+RingProgressStore::RingProgressStore(size_t capacity):
+  d(new Private(this, capacity))
+{
+
+}
+
+//##################################################################################################
+RingProgressStore::~RingProgressStore()
+{
+  delete d;
+}
+
+//##################################################################################################
+void RingProgressStore::initProgressEvent(ProgressEvent& progressEvent)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  progressEvent.store = this;
+  progressEvent.id = d->nextID++;
+
+  Private::Record& record = d->records[progressEvent.id%d->records.size()];
+  record.id = progressEvent.id;
+  Private::copy(progressEvent, record);
+}
+
+//##################################################################################################
+void RingProgressStore::updateProgressEvent(const ProgressEvent& progressEvent)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  assert(progressEvent.store == this);
+  if(Private::Record* record = d->record(progressEvent.id); record)
+    Private::copy(progressEvent, *record);
+}
+
+//##################################################################################################
+void RingProgressStore::viewProgressEvents(const std::function<void(const std::vector<ProgressEvent>&)>& closure)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  closure(d->progressEvents());
+}
+
+//##################################################################################################
+void RingProgressStore::saveState(nlohmann::json& j) const
+{
+  j = nlohmann::json::array();
+
+  std::vector<ProgressEvent> progressEvents = d->mutex.locked(TPMc [&]{return d->progressEvents();});
+
+  j.get_ptr<nlohmann::json::array_t*>()->reserve(progressEvents.size());
+  for(const auto& progressEvent : progressEvents)
+  {
+    j.emplace_back();
+    progressEvent.saveState(j.back());
+  }
+}
+
+//##################################################################################################
+size_t RingProgressStore::capacity() const
+{
+  return d->records.size();
+}
+
+//##################################################################################################
+size_t RingProgressStore::droppedEvents() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  size_t count = d->nextID-1;
+  return (count>d->records.size())?(count-d->records.size()):0;
+}
+
 ////##################################################################################################
 //std::string RAMProgressStore::saveState() const
 //{
@@ -189,6 +372,28 @@ struct Progress::Private
   std::function<bool()> poll;
   Progress* parent{nullptr};
 
+  //! The top of the tree, change notifications are rate limited here.
+  Progress* root{nullptr};
+
+  // A lock free view of the current step. While leafStep is set the fraction of the last child step
+  // lives in stepFraction rather than in childSteps, so that setProgress() only needs atomic stores.
+  std::atomic_bool leafStep{false};
+  std::atomic<float> stepFraction{0.0f};
+  std::atomic<float> stepMin{0.0f};
+  std::atomic<float> stepMax{1.0f};
+  std::atomic<Progress*> activeChild{nullptr};
+
+  //! The value returned by progress(), kept up to date by children as they progress.
+  std::atomic<float> aggregate{0.0f};
+  std::atomic<int64_t> lastUpdateNS{0};
+
+  // Only used on the root.
+  std::atomic<int64_t> minimumNotificationIntervalUS{0};
+  std::atomic<int64_t> lastNotificationUS{0};
+  std::atomic_bool dirty{false};
+  std::atomic_bool flushTimerArmed{false};
+  std::unique_ptr<ServiceTimer> flushTimer;
+
   AbstractProgressStore* progressStore{nullptr};
   std::optional<ProgressEvent> progressEvent;
 
@@ -199,6 +404,7 @@ struct Progress::Private
           const std::string& message):
     q(q_),
     parent(parent_),
+    root(parent_?parent_->d->root:q_),
     progressStore(progressStore_?progressStore_:globalProgressStore_)
   {
     if(progressStore)
@@ -209,8 +415,8 @@ struct Progress::Private
       if(parent)
         parent->viewProgressEvent([&](const auto& p){progressEvent->parentId = p.id;});
 
-      progressEvent->start = currentTimeMS();
-      progressEvent->end = currentTimeMS();
+      progressEvent->start = monotonicTimeNS();
+      progressEvent->end = progressEvent->start;
 
       progressStore->initProgressEvent(*progressEvent);
     }
@@ -219,16 +425,73 @@ struct Progress::Private
   //################################################################################################
   ~Private()
   {
+    // Stop the timer before anything that it might call is destroyed.
+    flushTimer.reset();
+
     for(const auto& childStep : childSteps)
       delete childStep.childProgress;
 
     if(progressEvent)
     {
+      progressEvent->fraction = aggregate;
+      progressEvent->end = tpMax(progressEvent->end, lastUpdateNS.load());
       progressEvent->active = false;
       progressStore->updateProgressEvent(*progressEvent);
     }
   }
 
+  //################################################################################################
+  //! The fraction of a child step, the last step may be stored in stepFraction, requires mutex.
+  float childStepFraction(size_t index) const
+  {
+    if(index+1==childSteps.size() && leafStep)
+      return stepFraction;
+    return childSteps.at(index).fraction;
+  }
+
+  //################################################################################################
+  //! Set the fraction of the current leaf step and pass the new aggregate up the tree.
+  void setLeafFraction(float fraction)
+  {
+    stepFraction.store(fraction, std::memory_order_relaxed);
+    aggregate.store(fraction, std::memory_order_relaxed);
+    lastUpdateNS.store(monotonicTimeNS(), std::memory_order_relaxed);
+    propagateAggregate();
+  }
+
+  //################################################################################################
+  //! Update the aggregate of each parent for which this is the active child step.
+  void propagateAggregate()
+  {
+    for(Progress* c=q; c->d->parent; c=c->d->parent)
+    {
+      Private* pd = c->d->parent->d;
+      if(pd->activeChild.load(std::memory_order_relaxed) != c)
+        break;
+
+      float min = pd->stepMin.load(std::memory_order_relaxed);
+      float max = pd->stepMax.load(std::memory_order_relaxed);
+      pd->aggregate.store(min + (max-min)*c->d->aggregate.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+  }
+
+  //################################################################################################
+  //! Start a new step, requires mutex.
+  void beginStep(float min, float max, float fraction, Progress* child)
+  {
+    // Move the fraction of the outgoing leaf step back into childSteps.
+    if(leafStep && childSteps.size()>1)
+      childSteps.at(childSteps.size()-2).fraction = stepFraction;
+
+    leafStep = (child==nullptr);
+    activeChild = child;
+    stepMin = min;
+    stepMax = max;
+    stepFraction = fraction;
+    aggregate = child?min:fraction;
+    propagateAggregate();
+  }
+
   //################################################################################################
   void updateThis(const std::function<void(ChildStep_lt&)>& closure)
   {
@@ -254,11 +517,70 @@ struct Progress::Private
       newChildStep.min = min;
       newChildStep.max = 1.0f;
       newChildStep.fraction = min;
+      beginStep(min, 1.0f, min, nullptr);
     }
 
     closure(childSteps.back());
   }
 
+  //################################################################################################
+  //! Called on the root when something in the tree has changed.
+  void notifyChanged()
+  {
+    if(minimumNotificationIntervalUS.load(std::memory_order_relaxed)<=0)
+    {
+      deliverChanged();
+      return;
+    }
+
+    dirty = true;
+    flushChanged();
+  }
+
+  //################################################################################################
+  //! Deliver a pending notification if the minimum interval has passed since the last one.
+  void flushChanged()
+  {
+    if(!dirty.load())
+      return;
+
+    int64_t nowUS = steadyTimeUS();
+    int64_t lastUS = lastNotificationUS.load();
+    int64_t waitUS = lastUS + minimumNotificationIntervalUS.load(std::memory_order_relaxed) - nowUS;
+    if(waitUS>0)
+    {
+      // Cross thread roots can be flushed from the timer thread, others are flushed by poll().
+      if(crossThreadCallback && !flushTimerArmed.exchange(true))
+      {
+        if(!flushTimer)
+          flushTimer = std::make_unique<ServiceTimer>([&]
+          {
+            flushTimer->stop();
+            flushTimerArmed = false;
+            flushChanged();
+          });
+        flushTimer->start(waitUS);
+      }
+      return;
+    }
+
+    // Only one thread gets to deliver each notification.
+    if(!lastNotificationUS.compare_exchange_strong(lastUS, nowUS))
+      return;
+
+    dirty = false;
+    deliverChanged();
+  }
+
+  //################################################################################################
+  void deliverChanged()
+  {
+    if(crossThreadCallback)
+      crossThreadCallback->call();
+    else
+      q->changed();
+  }
+
   //################################################################################################
   std::string formatText(const std::string& text)
   {
@@ -307,14 +629,13 @@ struct Progress::Private
   }
 
   //################################################################################################
-  void updateProgressEventEnd(ChildStep_lt& childStep, bool active)
+  //! Write the current state to the progress store, requires mutex.
+  void updateProgressEventEnd(bool active)
   {
     updateProgressEvent([&](ProgressEvent& progressEvent)
     {
-      progressEvent.fraction = childStep.max - childStep.min;
-      progressEvent.fraction *= childStep.fraction;
-      progressEvent.fraction += childStep.min;
-      progressEvent.end = currentTimeMS();
+      progressEvent.fraction = aggregate;
+      progressEvent.end = monotonicTimeNS();
       progressEvent.active = active;
     });
   }
@@ -326,7 +647,7 @@ Progress::Progress(AbstractCrossThreadCallbackFactory* crossThreadCallbackFactor
                    AbstractProgressStore* progressStore):
   d(new Private(this, progressStore, nullptr, message))
 {
-  d->crossThreadCallback = crossThreadCallbackFactory->produceP([&]{changed();});
+  d->crossThreadCallback = crossThreadCallbackFactory->produceP([&]{changed();}, CrossThreadCallbackMode::Coalesced);
 }
 
 //##################################################################################################
@@ -353,6 +674,12 @@ Progress::~Progress()
   delete d;
 }
 
+//##################################################################################################
+void Progress::setMinimumNotificationIntervalMS(int64_t intervalMS)
+{
+  d->root->d->minimumNotificationIntervalUS = intervalMS*1000;
+}
+
 //##################################################################################################
 void Progress::setPrintToConsole(bool printToConsole)
 {
@@ -368,11 +695,22 @@ void Progress::setPrintToFile(const std::string& printToFile)
 //##################################################################################################
 void Progress::setProgress(float fraction)
 {
-  d->updateThis([&](ChildStep_lt& childStep)
+  // Fast path, the current step is a leaf so no locks are needed. The progress store is only
+  // updated when the step completes, or by the next operation that takes the mutex.
+  if(d->leafStep.load(std::memory_order_acquire))
   {
-    childStep.fraction = fraction;
-    d->updateProgressEventEnd(childStep, fraction<=0.99999f);
-  });
+    d->setLeafFraction(fraction);
+    if(fraction>0.99999f)
+      d->mutex.locked(TPMc [&]{d->updateProgressEventEnd(false);});
+  }
+  else
+  {
+    d->updateThis([&](ChildStep_lt&)
+    {
+      d->setLeafFraction(fraction);
+      d->updateProgressEventEnd(fraction<=0.99999f);
+    });
+  }
 
   callChanged();
 }
@@ -382,9 +720,9 @@ void Progress::setProgress(float fraction, const std::string& message)
 {
   d->updateThis([&](ChildStep_lt& childStep)
   {
-    childStep.fraction = fraction;
     childStep.messages.emplace_back(message, false, 0);
-    d->updateProgressEventEnd(childStep, fraction<=0.99999f);
+    d->setLeafFraction(fraction);
+    d->updateProgressEventEnd(fraction<=0.99999f);
   });
 
   callChanged();
@@ -412,22 +750,7 @@ std::string Progress::description() const
 //##################################################################################################
 float Progress::progress() const
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  if(d->childSteps.empty())
-    return 0.0f;
-
-  const ChildStep_lt& childStep = d->childSteps.back();
-
-  if(childStep.childProgress)
-  {
-    float fraction = childStep.max - childStep.min;
-    fraction *= childStep.childProgress->progress();
-    fraction += childStep.min;
-
-    return fraction;
-  }
-
-  return childStep.fraction;
+  return d->aggregate.load(std::memory_order_relaxed);
 }
 
 //##################################################################################################
@@ -451,6 +774,9 @@ bool Progress::poll()
   else if(d->poll)
     ok&=d->poll();
 
+  if(!d->parent)
+    d->flushChanged();
+
   TP_MUTEX_LOCKER(d->mutex);
   if(!ok)
     d->shouldStop = true;
@@ -482,9 +808,10 @@ void Progress::copyChildSteps(Progress* progress, const std::string& message, fl
 {  
   auto dstChildStep = addChildStep(message, completeFraction);
 
-  for(const auto& childStep : progress->d->childSteps)
+  for(size_t i=0; i<progress->d->childSteps.size(); i++)
   {
-    dstChildStep->setProgress(childStep.fraction);
+    const auto& childStep = progress->d->childSteps.at(i);
+    dstChildStep->setProgress(progress->d->childStepFraction(i));
 
     for(size_t m=0; m<childStep.messages.size(); m++)
     {
@@ -519,9 +846,9 @@ Progress* Progress::addChildStep(const std::string& message, float completeFract
       if(childStep.childProgress)
         min = childStep.max;
       else
-        min = childStep.fraction;
+        min = d->childStepFraction(d->childSteps.size()-1);
 
-      d->updateProgressEventEnd(childStep, false);
+      d->updateProgressEventEnd(false);
     }
 
     ChildStep_lt& childStep = d->childSteps.emplace_back();
@@ -533,7 +860,8 @@ Progress* Progress::addChildStep(const std::string& message, float completeFract
 
     childProgress = childStep.childProgress;
 
-    d->updateProgressEventEnd(childStep, true);
+    d->beginStep(min, completeFraction, 0.0f, childProgress);
+    d->updateProgressEventEnd(true);
   });
 
   callChanged();
@@ -560,7 +888,7 @@ void Progress::addError(const std::string& error)
   d->updateThis([&](ChildStep_lt& childStep)
   {
     childStep.messages.emplace_back(error, true, 0);
-    d->updateProgressEventEnd(childStep, false);
+    d->updateProgressEventEnd(false);
   });
 
   callChanged();
@@ -618,12 +946,7 @@ bool Progress::shouldStop() const
 //##################################################################################################
 void Progress::callChanged()
 {
-  if(d->parent)
-    d->parent->callChanged();
-  else if(d->crossThreadCallback)
-    d->crossThreadCallback->call();
-  else
-    changed();
+  d->root->d->notifyChanged();
 }
 
 //##################################################################################################
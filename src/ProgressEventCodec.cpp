@@ -0,0 +1,383 @@
+#include "tp_utils/ProgressEventCodec.h"
+#include "tp_utils/JSONUtils.h"
+#include "tp_utils/DebugUtils.h"
+#include "tp_utils/TimeUtils.h"
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <cstring>
+#include <unordered_map>
+
+namespace tp_utils
+{
+
+namespace
+{
+constexpr char magic[4]{'T','P','P','E'};
+constexpr uint8_t formatVersion{1};
+
+//! Longer names are treated as a corrupt stream rather than trusting the size to allocate.
+constexpr uint64_t maxNameSize{1024*1024};
+
+enum Flags : uint8_t
+{
+  Active       = 1<<0,
+  FractionZero = 1<<1,
+  FractionOne  = 1<<2,
+  SameColor    = 1<<3,
+  HasAlpha     = 1<<4,
+  SameThread   = 1<<5
+};
+
+//##################################################################################################
+uint64_t zigZag(int64_t value)
+{
+  return (uint64_t(value)<<1) ^ uint64_t(value>>63);
+}
+
+//##################################################################################################
+int64_t unZigZag(uint64_t value)
+{
+  return int64_t(value>>1) ^ -int64_t(value&1);
+}
+
+//##################################################################################################
+void writeVarint(std::string& buffer, uint64_t value)
+{
+  while(value>=0x80)
+  {
+    buffer.push_back(char(uint8_t(value) | 0x80));
+    value>>=7;
+  }
+  buffer.push_back(char(uint8_t(value)));
+}
+
+//##################################################################################################
+int64_t delta(uint64_t a, uint64_t b)
+{
+  return int64_t(a-b);
+}
+}
+
+//##################################################################################################
+struct ProgressEventEncoder::Private
+{
+  std::ostream& out;
+  std::unordered_map<std::string, uint64_t> names;
+  std::string buffer;
+
+  ProgressEvent previous;
+
+  //################################################################################################
+  Private(std::ostream& out_):
+    out(out_)
+  {
+    previous.color = TPPixel(0, 0, 0, 0);
+  }
+};
+
+//##################################################################################################
+ProgressEventEncoder::ProgressEventEncoder(std::ostream& out):
+  d(new Private(out))
+{
+  d->out.write(magic, sizeof(magic));
+  d->out.put(char(formatVersion));
+
+  // Times are from the monotonic clock, the offset lets a reader convert them to its own.
+  int64_t epochOffsetNS = monotonicToEpochOffsetNS();
+  char bytes[sizeof(epochOffsetNS)];
+  for(size_t i=0; i<sizeof(bytes); i++)
+    bytes[i] = char(uint8_t(uint64_t(epochOffsetNS)>>(i*8)));
+  d->out.write(bytes, sizeof(bytes));
+}
+
+//##################################################################################################
+ProgressEventEncoder::~ProgressEventEncoder()
+{
+  delete d;
+}
+
+//##################################################################################################
+void ProgressEventEncoder::write(const ProgressEvent& progressEvent)
+{
+  std::string& buffer = d->buffer;
+  buffer.clear();
+
+  // 0 introduces a new name, otherwise the index of the name plus 1.
+  if(auto i=d->names.find(progressEvent.name); i!=d->names.end())
+    writeVarint(buffer, i->second+1);
+  else
+  {
+    writeVarint(buffer, 0);
+    writeVarint(buffer, progressEvent.name.size());
+    buffer.append(progressEvent.name);
+    d->names.emplace(progressEvent.name, d->names.size());
+  }
+
+  const ProgressEvent& previous = d->previous;
+  uint8_t flags{0};
+  if(progressEvent.active)
+    flags |= Active;
+  if(progressEvent.fraction==0.0f)
+    flags |= FractionZero;
+  else if(progressEvent.fraction==1.0f)
+    flags |= FractionOne;
+  if(progressEvent.color.i == previous.color.i)
+    flags |= SameColor;
+  else if(progressEvent.color.a != 255)
+    flags |= HasAlpha;
+  if(progressEvent.threadId == previous.threadId)
+    flags |= SameThread;
+  buffer.push_back(char(flags));
+
+  writeVarint(buffer, zigZag(delta(progressEvent.id, previous.id)));
+  writeVarint(buffer, zigZag(delta(progressEvent.parentId, previous.parentId)));
+  writeVarint(buffer, zigZag(progressEvent.start - previous.start));
+  writeVarint(buffer, zigZag(progressEvent.end - progressEvent.start));
+
+  if(!(flags & (FractionZero|FractionOne)))
+  {
+    char bytes[sizeof(float)];
+    std::memcpy(bytes, &progressEvent.fraction, sizeof(float));
+    buffer.append(bytes, sizeof(float));
+  }
+
+  if(!(flags & SameColor))
+  {
+    buffer.push_back(char(progressEvent.color.r));
+    buffer.push_back(char(progressEvent.color.g));
+    buffer.push_back(char(progressEvent.color.b));
+    if(flags & HasAlpha)
+      buffer.push_back(char(progressEvent.color.a));
+  }
+
+  if(!(flags & SameThread))
+    writeVarint(buffer, progressEvent.threadId);
+
+  d->out.write(buffer.data(), std::streamsize(buffer.size()));
+
+  d->previous.id = progressEvent.id;
+  d->previous.parentId = progressEvent.parentId;
+  d->previous.start = progressEvent.start;
+  d->previous.color = progressEvent.color;
+  d->previous.threadId = progressEvent.threadId;
+}
+
+//##################################################################################################
+struct ProgressEventDecoder::Private
+{
+  std::istream& in;
+  std::vector<std::string> names;
+  int64_t shiftNS{0}; //!< Added to times to move them from the writer's monotonic clock to ours.
+  bool error{false};
+  bool end{false};
+
+  ProgressEvent previous;
+
+  //################################################################################################
+  Private(std::istream& in_):
+    in(in_)
+  {
+    previous.color = TPPixel(0, 0, 0, 0);
+  }
+
+  //################################################################################################
+  bool readByte(uint8_t& value)
+  {
+    int c = in.get();
+    if(c==std::char_traits<char>::eof())
+      return false;
+    value = uint8_t(c);
+    return true;
+  }
+
+  //################################################################################################
+  bool readVarint(uint64_t& value)
+  {
+    value=0;
+    for(int shift=0; shift<64; shift+=7)
+    {
+      uint8_t byte{0};
+      if(!readByte(byte))
+        return false;
+
+      value |= uint64_t(byte&0x7F) << shift;
+      if(!(byte&0x80))
+        return true;
+    }
+    return false;
+  }
+
+  //################################################################################################
+  bool readBytes(char* bytes, size_t size)
+  {
+    in.read(bytes, std::streamsize(size));
+    return size_t(in.gcount())==size;
+  }
+
+  //################################################################################################
+  bool readRecord(ProgressEvent& progressEvent)
+  {
+    uint64_t nameRef{0};
+    if(!readVarint(nameRef))
+      return false;
+
+    if(nameRef==0)
+    {
+      uint64_t size{0};
+      if(!readVarint(size) || size>maxNameSize)
+        return false;
+
+      std::string& name = names.emplace_back();
+      name.resize(size_t(size));
+      if(!readBytes(name.data(), name.size()))
+        return false;
+      progressEvent.name = name;
+    }
+    else if(nameRef<=names.size())
+      progressEvent.name = names.at(size_t(nameRef-1));
+    else
+      return false;
+
+    uint8_t flags{0};
+    uint64_t id{0};
+    uint64_t parentId{0};
+    uint64_t start{0};
+    uint64_t duration{0};
+    if(!readByte(flags) || !readVarint(id) || !readVarint(parentId) || !readVarint(start) || !readVarint(duration))
+      return false;
+
+    progressEvent.active = flags & Active;
+    progressEvent.id = size_t(uint64_t(previous.id) + uint64_t(unZigZag(id)));
+    progressEvent.parentId = size_t(uint64_t(previous.parentId) + uint64_t(unZigZag(parentId)));
+    progressEvent.start = previous.start + unZigZag(start);
+    progressEvent.end = progressEvent.start + unZigZag(duration);
+
+    if(flags & FractionZero)
+      progressEvent.fraction = 0.0f;
+    else if(flags & FractionOne)
+      progressEvent.fraction = 1.0f;
+    else
+    {
+      char bytes[sizeof(float)];
+      if(!readBytes(bytes, sizeof(float)))
+        return false;
+      std::memcpy(&progressEvent.fraction, bytes, sizeof(float));
+    }
+
+    if(flags & SameColor)
+      progressEvent.color = previous.color;
+    else
+    {
+      uint8_t rgba[4]{0, 0, 0, 255};
+      if(!readBytes(reinterpret_cast<char*>(rgba), (flags & HasAlpha)?4:3))
+        return false;
+      progressEvent.color = TPPixel(rgba[0], rgba[1], rgba[2], rgba[3]);
+    }
+
+    if(flags & SameThread)
+      progressEvent.threadId = previous.threadId;
+    else if(!readVarint(progressEvent.threadId))
+      return false;
+
+    previous.id = progressEvent.id;
+    previous.parentId = progressEvent.parentId;
+    previous.start = progressEvent.start;
+    previous.color = progressEvent.color;
+    previous.threadId = progressEvent.threadId;
+
+    // Deltas are from the writer's clock so shift after updating previous.
+    progressEvent.start += shiftNS;
+    progressEvent.end += shiftNS;
+    return true;
+  }
+};
+
+//##################################################################################################
+ProgressEventDecoder::ProgressEventDecoder(std::istream& in):
+  d(new Private(in))
+{
+  // The magic, the version, then the writer's epoch offset as 8 little endian bytes.
+  uint8_t header[sizeof(magic)+1+sizeof(int64_t)]{};
+  if(!d->readBytes(reinterpret_cast<char*>(header), sizeof(header)) ||
+     std::memcmp(header, magic, sizeof(magic))!=0 ||
+     header[sizeof(magic)]!=formatVersion)
+  {
+    d->error = true;
+    d->end = true;
+    return;
+  }
+
+  uint64_t epochOffsetNS{0};
+  for(size_t i=0; i<sizeof(int64_t); i++)
+    epochOffsetNS |= uint64_t(header[sizeof(magic)+1+i])<<(i*8);
+  d->shiftNS = int64_t(epochOffsetNS) - monotonicToEpochOffsetNS();
+}
+
+//##################################################################################################
+ProgressEventDecoder::~ProgressEventDecoder()
+{
+  delete d;
+}
+
+//##################################################################################################
+bool ProgressEventDecoder::read(ProgressEvent& progressEvent)
+{
+  if(d->end)
+    return false;
+
+  // A clean end of stream is only allowed between records.
+  if(d->in.peek()==std::char_traits<char>::eof())
+  {
+    d->end = true;
+    return false;
+  }
+
+  progressEvent = ProgressEvent();
+  if(!d->readRecord(progressEvent))
+  {
+    d->error = true;
+    d->end = true;
+    return false;
+  }
+
+  return true;
+}
+
+//##################################################################################################
+bool ProgressEventDecoder::error() const
+{
+  return d->error;
+}
+
+//##################################################################################################
+void saveProgressEventsBinary(const std::vector<ProgressEvent>& progressEvents, std::string& data)
+{
+  std::ostringstream out;
+  ProgressEventEncoder encoder(out);
+  for(const auto& progressEvent : progressEvents)
+    encoder.write(progressEvent);
+  data = out.str();
+}
+
+//##################################################################################################
+std::vector<ProgressEvent> loadProgressEvents(const std::string& data)
+{
+  if(data.size()<sizeof(magic) || std::memcmp(data.data(), magic, sizeof(magic))!=0)
+    return RAMProgressStore::loadState(jsonFromString(data));
+
+  std::vector<ProgressEvent> progressEvents;
+  std::istringstream in(data);
+  ProgressEventDecoder decoder(in);
+  ProgressEvent progressEvent;
+  while(decoder.read(progressEvent))
+    progressEvents.push_back(progressEvent);
+
+  if(decoder.error())
+    tpWarning() << "Failed to read all progress events, loaded: " << progressEvents.size();
+
+  return progressEvents;
+}
+
+}
@@ -0,0 +1,375 @@
+#include "tp_utils/SamplingProfiler.h"
+
+#if defined(TP_ENABLE_PROFILING) && defined(TP_LINUX)
+
+#include "tp_utils/ProfilerController.h"
+#include "tp_utils/TimerService.h"
+#include "tp_utils/MutexUtils.h"
+#include "tp_utils/DebugUtils.h"
+
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <unordered_map>
+#include <map>
+#include <memory>
+
+namespace tp_utils
+{
+
+namespace
+{
+constexpr size_t maxFrames{64};
+constexpr size_t ringSize{8192};
+
+//! The signal handler and the signal trampoline.
+constexpr size_t skipFrames{2};
+
+//##################################################################################################
+struct Sample
+{
+  //! Set to index+1 once the sample that was reserved at index has been written.
+  std::atomic<uint64_t> sequence{0};
+  int depth{0};
+  std::array<void*, maxFrames> frames;
+};
+
+//##################################################################################################
+//! Written by the signal handler, drained by SamplingProfiler.
+struct SampleRing
+{
+  std::array<Sample, ringSize> samples;
+  std::atomic<uint64_t> writeIndex{0};
+  std::atomic<uint64_t> readIndex{0};
+  std::atomic<uint64_t> dropped{0};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// The ring is never freed because a signal may still be being handled on another thread after
+// sampling has stopped.
+std::atomic<SampleRing*> ring{nullptr};
+std::atomic_bool sampling{false};
+
+//##################################################################################################
+void sigprofHandler(int)
+{
+  int savedErrno = errno;
+
+  if(SampleRing* r = ring.load(std::memory_order_acquire); r && sampling.load(std::memory_order_relaxed))
+  {
+    // Reserve a slot, or drop the sample if the reader has fallen a full ring behind.
+    uint64_t index = r->writeIndex.load(std::memory_order_relaxed);
+    bool reserved = false;
+    while(index - r->readIndex.load(std::memory_order_acquire) < ringSize)
+    {
+      if(r->writeIndex.compare_exchange_weak(index, index+1, std::memory_order_relaxed))
+      {
+        reserved = true;
+        break;
+      }
+    }
+
+    if(reserved)
+    {
+      Sample& sample = r->samples[index%ringSize];
+      sample.depth = backtrace(sample.frames.data(), int(maxFrames));
+      sample.sequence.store(index+1, std::memory_order_release);
+    }
+    else
+      r->dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  errno = savedErrno;
+}
+
+//##################################################################################################
+struct StackHash
+{
+  size_t operator()(const std::vector<void*>& stack) const
+  {
+    size_t hash = std::hash<void*>()(nullptr);
+    for(void* frame : stack)
+      hash ^= std::hash<void*>()(frame) + 0x9e3779b9 + (hash<<6) + (hash>>2);
+    return hash;
+  }
+};
+
+//##################################################################################################
+std::string symbolize(void* address)
+{
+  // dladdr() fails for JIT and vDSO frames, info is only valid if it succeeds.
+  Dl_info info{};
+  bool found = dladdr(address, &info)!=0;
+  if(found && info.dli_sname)
+  {
+    int status=0;
+    std::unique_ptr<char, decltype(&free)> demangled(abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status), &free);
+    return (status==0 && demangled)?std::string(demangled.get()):std::string(info.dli_sname);
+  }
+
+  char buffer[32];
+  if(found && info.dli_fname && info.dli_fbase)
+  {
+    std::string module = info.dli_fname;
+    if(auto slash = module.find_last_of('/'); slash!=std::string::npos)
+      module = module.substr(slash+1);
+    snprintf(buffer, sizeof(buffer), "+0x%zx", size_t(static_cast<char*>(address) - static_cast<char*>(info.dli_fbase)));
+    return module + buffer;
+  }
+
+  snprintf(buffer, sizeof(buffer), "%p", address);
+  return buffer;
+}
+}
+
+//##################################################################################################
+struct SamplingProfiler::Private
+{
+  ProfilerController* controller;
+
+  TPMutex mutex{TPM};
+  std::unordered_map<std::vector<void*>, size_t, StackHash> stacks;
+  size_t sampleCount{0};
+  size_t droppedBase{0};
+  bool running{false};
+
+  std::unique_ptr<ServiceTimer> drainTimer;
+
+  //################################################################################################
+  Private(ProfilerController* controller_):
+    controller(controller_)
+  {
+
+  }
+
+  //################################################################################################
+  //! Move samples from the ring into stacks, requires mutex.
+  void drain()
+  {
+    SampleRing* r = ring.load(std::memory_order_acquire);
+    if(!r)
+      return;
+
+    std::vector<void*> stack;
+    uint64_t index = r->readIndex.load(std::memory_order_relaxed);
+    for(;; index++)
+    {
+      const Sample& sample = r->samples[index%ringSize];
+      if(sample.sequence.load(std::memory_order_acquire) != index+1)
+        break;
+
+      // Store root first, as collapsed stacks are written.
+      stack.clear();
+      for(int i=sample.depth-1; i>=int(skipFrames); i--)
+        stack.push_back(sample.frames[size_t(i)]);
+
+      stacks[stack]++;
+      sampleCount++;
+      r->readIndex.store(index+1, std::memory_order_release);
+    }
+  }
+};
+
+//##################################################################################################
+SamplingProfiler::SamplingProfiler(ProfilerController* controller):
+  d(new Private(controller))
+{
+
+}
+
+//##################################################################################################
+SamplingProfiler::~SamplingProfiler()
+{
+  stop();
+  delete d;
+}
+
+//##################################################################################################
+bool SamplingProfiler::start(int64_t intervalUS)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  if(d->running)
+    return true;
+
+  bool expected=false;
+  if(!sampling.compare_exchange_strong(expected, true))
+  {
+    tpWarning() << "SamplingProfiler::start() another sampling profiler is already running.";
+    return false;
+  }
+
+  // The ring is only published once the handler is installed, so a ring means that it is safe to
+  // arm the timer.
+  if(!ring.load())
+  {
+    // The first call to backtrace() loads libgcc, which is not safe from a signal handler.
+    void* frames[4];
+    backtrace(frames, 4);
+
+    // The handler is left installed after stop() because SIGPROF would otherwise terminate the
+    // process if a signal is still pending, it does nothing while sampling is false.
+    struct sigaction action{};
+    action.sa_handler = sigprofHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, nullptr)!=0)
+    {
+      tpWarning() << "SamplingProfiler::start() failed to install SIGPROF handler: " << std::strerror(errno);
+      sampling = false;
+      return false;
+    }
+
+    ring = new SampleRing();
+  }
+
+  intervalUS = tpMax(int64_t(1), intervalUS);
+  itimerval timer{};
+  timer.it_interval.tv_sec = intervalUS/1000000;
+  timer.it_interval.tv_usec = intervalUS%1000000;
+  timer.it_value = timer.it_interval;
+  if(setitimer(ITIMER_PROF, &timer, nullptr)!=0)
+  {
+    tpWarning() << "SamplingProfiler::start() setitimer failed: " << std::strerror(errno);
+    sampling = false;
+    return false;
+  }
+
+  d->running = true;
+  d->drainTimer = std::make_unique<ServiceTimer>([this]{d->mutex.locked(TPMc [&]{d->drain();});});
+  d->drainTimer->start(50000);
+
+  TP_MUTEX_UNLOCKER(d->mutex);
+  d->controller->changed();
+  return true;
+}
+
+//##################################################################################################
+void SamplingProfiler::stop()
+{
+  std::unique_ptr<ServiceTimer> drainTimer;
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    if(!d->running)
+      return;
+
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sampling = false;
+    d->running = false;
+    d->drain();
+    drainTimer = std::move(d->drainTimer);
+  }
+
+  // Destroying the timer waits for a running drain, which needs the mutex.
+  drainTimer.reset();
+  d->controller->changed();
+}
+
+//##################################################################################################
+bool SamplingProfiler::isRunning() const
+{
+  return d->mutex.locked(TPMc [&]{return d->running;});
+}
+
+//##################################################################################################
+void SamplingProfiler::clear()
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->drain();
+  d->stacks.clear();
+  d->sampleCount = 0;
+  if(SampleRing* r = ring.load(); r)
+    d->droppedBase = size_t(r->dropped.load());
+}
+
+//##################################################################################################
+size_t SamplingProfiler::sampleCount() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->drain();
+  return d->sampleCount;
+}
+
+//##################################################################################################
+size_t SamplingProfiler::droppedSamples() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  SampleRing* r = ring.load();
+  return r?(size_t(r->dropped.load()) - d->droppedBase):0;
+}
+
+//##################################################################################################
+std::string SamplingProfiler::collapsedStacks() const
+{
+  std::vector<std::pair<std::vector<void*>, size_t>> stacks;
+  d->mutex.locked(TPMc [&]
+  {
+    d->drain();
+    stacks.assign(d->stacks.begin(), d->stacks.end());
+  });
+
+  // Symbolize each address once, non leaf frames are return addresses so look up the call.
+  std::unordered_map<void*, std::string> names;
+  auto name = [&](void* address, bool leaf) -> const std::string&
+  {
+    void* lookup = leaf?address:static_cast<void*>(static_cast<char*>(address)-1);
+    auto i = names.find(lookup);
+    if(i == names.end())
+    {
+      std::string n = symbolize(lookup);
+      std::replace(n.begin(), n.end(), ';', ':');
+      i = names.emplace(lookup, std::move(n)).first;
+    }
+    return i->second;
+  };
+
+  // Different addresses in the same function produce the same line, so merge them here.
+  std::map<std::string, size_t> lines;
+  for(const auto& [stack, count] : stacks)
+  {
+    if(stack.empty())
+      continue;
+
+    std::string line;
+    for(size_t i=0; i<stack.size(); i++)
+    {
+      if(i)
+        line += ';';
+      line += name(stack.at(i), i+1==stack.size());
+    }
+    lines[line] += count;
+  }
+
+  std::string result;
+  for(const auto& [line, count] : lines)
+  {
+    result += line;
+    result += ' ';
+    result += std::to_string(count);
+    result += '\n';
+  }
+
+  return result;
+}
+
+}
+
+#else
+
+// Silence warning for empty .o file
+int samplingProfiler_cpp()
+{
+  return 0;
+}
+
+#endif
@@ -34,6 +34,37 @@ int64_t currentTimeMicroseconds()
   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
 }
 
+//##################################################################################################
+int64_t monotonicTimeNS()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//##################################################################################################
+int64_t monotonicToEpochOffsetNS()
+{
+  static const int64_t offset = []
+  {
+    int64_t before = monotonicTimeNS();
+    int64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    int64_t after = monotonicTimeNS();
+    return epoch - (before + (after-before)/2);
+  }();
+  return offset;
+}
+
+//##################################################################################################
+int64_t monotonicNSToTimeMS(int64_t ns)
+{
+  return (ns + monotonicToEpochOffsetNS()) / 1000000;
+}
+
+//##################################################################################################
+int64_t timeMSToMonotonicNS(int64_t ms)
+{
+  return ms*1000000 - monotonicToEpochOffsetNS();
+}
+
 //##################################################################################################
 struct ElapsedTimer::Private
 {
@@ -0,0 +1,511 @@
+#include "tp_utils/TimerService.h"
+#include "tp_utils/MutexUtils.h"
+
+#include "lib_platform/SetThreadName.h"
+
+#include <thread>
+#include <chrono>
+#include <array>
+#include <utility>
+
+namespace tp_utils
+{
+
+namespace
+{
+//##################################################################################################
+int64_t steadyTimeUS()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+constexpr int64_t tickUS{1000};
+constexpr size_t levelCount{4};
+constexpr size_t slotBits{8};
+constexpr size_t slotCount{1<<slotBits};
+constexpr size_t slotMask{slotCount-1};
+constexpr int64_t maxDelta{(int64_t(1)<<(slotBits*levelCount))-1};
+}
+
+//##################################################################################################
+struct ServiceTimer::Private
+{
+  std::shared_ptr<TimerService> service;
+  std::function<void()> callback;
+
+  // Everything below is protected by the service mutex.
+  int64_t intervalUS{0};
+  int64_t deadlineUS{0};
+  bool fixedRate{false};
+  MissedTickPolicy policy{MissedTickPolicy::Skip};
+  TimerJitterStats stats;
+  bool active{false};
+  bool running{false};
+  std::thread::id runningThread;
+
+  //! Set if start() was called from the callback, the deadline it set is kept.
+  bool restarted{false};
+
+  //! Set if the timer was destroyed from its own callback, it is freed once the callback returns.
+  bool released{false};
+
+  // Intrusive links into either a wheel slot or the due list.
+  Private* prev{nullptr};
+  Private* next{nullptr};
+  Private** list{nullptr};
+  size_t level{0};
+  size_t slot{0};
+
+  //################################################################################################
+  Private(const std::function<void()>& callback_, const std::shared_ptr<TimerService>& service_):
+    service(service_),
+    callback(callback_)
+  {
+
+  }
+};
+
+//##################################################################################################
+struct TimerService::Private
+{
+  using Timer = ServiceTimer::Private;
+
+  //################################################################################################
+  struct Level
+  {
+    std::array<Timer*, slotCount> slots{};
+    std::array<uint64_t, slotCount/64> occupied{};
+
+    //##############################################################################################
+    bool isOccupied(size_t slot) const
+    {
+      return (occupied[slot/64] >> (slot%64)) & 1;
+    }
+
+    //##############################################################################################
+    //! Returns the offset from start to the next occupied slot (wrapping) or slotCount.
+    size_t nextOccupied(size_t start) const
+    {
+      for(size_t offset=0; offset<slotCount;)
+      {
+        size_t slot = (start+offset)&slotMask;
+        if((slot%64)==0 && occupied[slot/64]==0 && offset+64<=slotCount)
+        {
+          offset+=64;
+          continue;
+        }
+
+        if(isOccupied(slot))
+          return offset;
+        offset++;
+      }
+      return slotCount;
+    }
+  };
+
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  TPWaitCondition callbackFinished;
+  bool finish{false};
+
+  //! Set if the service was destroyed from its own thread, the thread frees this once run() returns.
+  bool deleteOnExit{false};
+
+  std::array<Level, levelCount> levels;
+  int64_t currentTick{0};
+  size_t count{0};
+
+  //! Timers that have expired and are waiting to be called.
+  Timer* due{nullptr};
+
+  std::thread thread;
+
+  //################################################################################################
+  Private(const std::string& threadName):
+    currentTick(steadyTimeUS()/tickUS),
+    thread([this, threadName]
+    {
+      run(threadName);
+      if(deleteOnExit)
+        delete this;
+    })
+  {
+
+  }
+
+  //################################################################################################
+  void link(Timer* timer, Timer** list)
+  {
+    timer->list = list;
+    timer->prev = nullptr;
+    timer->next = *list;
+    if(timer->next)
+      timer->next->prev = timer;
+    *list = timer;
+  }
+
+  //################################################################################################
+  void unlink(Timer* timer)
+  {
+    if(!timer->list)
+      return;
+
+    if(timer->prev)
+      timer->prev->next = timer->next;
+    else
+      *timer->list = timer->next;
+
+    if(timer->next)
+      timer->next->prev = timer->prev;
+
+    if(timer->list != &due)
+    {
+      count--;
+      if(!*timer->list)
+        levels[timer->level].occupied[timer->slot/64] &= ~(uint64_t(1) << (timer->slot%64));
+    }
+
+    timer->list = nullptr;
+    timer->prev = nullptr;
+    timer->next = nullptr;
+  }
+
+  //################################################################################################
+  void insert(Timer* timer)
+  {
+    int64_t tick = tpMax(timer->deadlineUS/tickUS, currentTick);
+    int64_t delta = tpMin(tick-currentTick, maxDelta);
+    tick = currentTick + delta;
+
+    size_t level=0;
+    while(level<levelCount-1 && delta>=(int64_t(1)<<(slotBits*(level+1))))
+      level++;
+
+    size_t slot = size_t(tick>>(slotBits*level))&slotMask;
+    timer->level = level;
+    timer->slot = slot;
+    link(timer, &levels[level].slots[slot]);
+    levels[level].occupied[slot/64] |= uint64_t(1) << (slot%64);
+    count++;
+  }
+
+  //################################################################################################
+  void cascade(size_t level)
+  {
+    size_t slot = size_t(currentTick>>(slotBits*level))&slotMask;
+    if(slot==0 && level+1<levelCount)
+      cascade(level+1);
+
+    while(Timer* timer = levels[level].slots[slot])
+    {
+      unlink(timer);
+      insert(timer);
+    }
+  }
+
+  //################################################################################################
+  //! Move expired timers to the due list.
+  void expire(int64_t nowUS)
+  {
+    int64_t nowTick = nowUS/tickUS;
+    if(count==0)
+    {
+      currentTick = tpMax(currentTick, nowTick);
+      return;
+    }
+
+    for(;;)
+    {
+      Timer* timer = levels[0].slots[size_t(currentTick)&slotMask];
+      while(timer)
+      {
+        Timer* next = timer->next;
+        if(timer->deadlineUS<=nowUS)
+        {
+          unlink(timer);
+          link(timer, &due);
+        }
+        else if(timer->deadlineUS/tickUS != currentTick)
+        {
+          unlink(timer);
+          insert(timer);
+        }
+        timer = next;
+      }
+
+      if(currentTick>=nowTick)
+        break;
+
+      currentTick++;
+      if((currentTick&int64_t(slotMask))==0)
+        cascade(1);
+    }
+  }
+
+  //################################################################################################
+  //! Returns the time that the next timer is due or INT64_MAX.
+  int64_t nextExpiryUS() const
+  {
+    if(due)
+      return 0;
+
+    if(count==0)
+      return INT64_MAX;
+
+    int64_t result = INT64_MAX;
+
+    // Timers in the current bottom slot may be due part way through this tick.
+    for(Timer* timer = levels[0].slots[size_t(currentTick)&slotMask]; timer; timer=timer->next)
+      result = tpMin(result, timer->deadlineUS);
+
+    for(size_t level=0; level<levelCount; level++)
+    {
+      int64_t base = currentTick>>(slotBits*level);
+      size_t start = (size_t(base)+1)&slotMask;
+      size_t offset = levels[level].nextOccupied(start);
+      if(offset==slotCount)
+        continue;
+
+      // Higher levels are cascaded at the start of their slot.
+      int64_t tick = (base+int64_t(offset)+1)<<(slotBits*level);
+      result = tpMin(result, tick*tickUS);
+    }
+
+    return result;
+  }
+
+  //################################################################################################
+  void run(const std::string& threadName)
+  {
+    lib_platform::setThreadName(threadName);
+
+    TPMutexLocker lock(mutex);
+    while(!finish)
+    {
+      expire(steadyTimeUS());
+
+      if(Timer* timer = due; timer)
+      {
+        unlink(timer);
+
+        int64_t jitterUS = tpMax(int64_t(0), steadyTimeUS() - timer->deadlineUS);
+        timer->stats.calls++;
+        timer->stats.totalJitterUS += jitterUS;
+        timer->stats.maxJitterUS = tpMax(timer->stats.maxJitterUS, jitterUS);
+
+        timer->running = true;
+        timer->restarted = false;
+        timer->runningThread = std::this_thread::get_id();
+        {
+          TP_MUTEX_UNLOCKER(lock);
+          timer->callback();
+        }
+        timer->running = false;
+        timer->runningThread = std::thread::id();
+
+        if(timer->released)
+        {
+          TP_MUTEX_UNLOCKER(lock);
+          delete timer;
+          continue;
+        }
+
+        if(timer->active)
+        {
+          // If start() was called from the callback it has already set the next deadline.
+          if(!timer->restarted)
+          {
+            if(timer->fixedRate)
+              scheduleNextTick(timer, steadyTimeUS());
+            else
+              timer->deadlineUS = steadyTimeUS() + timer->intervalUS;
+          }
+          insert(timer);
+        }
+
+        callbackFinished.wakeAll();
+        continue;
+      }
+
+      int64_t nextUS = nextExpiryUS();
+      if(nextUS==INT64_MAX)
+        waitCondition.wait(TPMc lock);
+      else if(int64_t waitUS = nextUS-steadyTimeUS(); waitUS>0)
+        waitCondition.waitUS(TPMc lock, waitUS);
+    }
+  }
+
+  //################################################################################################
+  //! Advance a fixed rate timer's deadline by one period, applying its policy if it has fallen behind.
+  void scheduleNextTick(Timer* timer, int64_t nowUS)
+  {
+    int64_t missed = (nowUS - timer->deadlineUS) / timer->intervalUS;
+    if(missed<1 || timer->policy == MissedTickPolicy::CatchUp)
+    {
+      timer->deadlineUS += timer->intervalUS;
+      return;
+    }
+
+    if(timer->policy == MissedTickPolicy::Skip)
+    {
+      timer->stats.missedTicks += size_t(missed);
+      timer->deadlineUS += (missed+1) * timer->intervalUS;
+    }
+    else
+    {
+      // Run once now in place of the most recent missed tick.
+      timer->stats.missedTicks += size_t(missed-1);
+      timer->deadlineUS += missed * timer->intervalUS;
+    }
+  }
+
+  //################################################################################################
+  void start(Timer* timer, int64_t intervalUS, bool fixedRate, MissedTickPolicy policy)
+  {
+    TP_MUTEX_LOCKER(mutex);
+    unlink(timer);
+    timer->active = true;
+    timer->fixedRate = fixedRate;
+    timer->policy = policy;
+    timer->intervalUS = tpMax(int64_t(1), intervalUS);
+    int64_t nowUS = steadyTimeUS();
+    timer->deadlineUS = nowUS + timer->intervalUS;
+
+    // The service thread does not advance the wheel while it is empty.
+    if(count==0 && !due)
+      currentTick = tpMax(currentTick, nowUS/tickUS);
+
+    // Only wake the service thread if this timer is now the first to expire.
+    bool wake = timer->deadlineUS < nextExpiryUS();
+
+    if(!timer->running)
+      insert(timer);
+    else
+      timer->restarted = true;
+
+    if(wake)
+      waitCondition.wakeOne();
+  }
+
+  //################################################################################################
+  void stop(Timer* timer)
+  {
+    TPMutexLocker lock(mutex);
+    timer->active = false;
+    unlink(timer);
+
+    if(timer->runningThread != std::this_thread::get_id())
+      while(timer->running)
+        callbackFinished.wait(TPMc lock);
+  }
+
+  //################################################################################################
+  //! Stop and free a timer, if this is called from the timer's own callback run() frees it later.
+  void release(Timer* timer)
+  {
+    {
+      TPMutexLocker lock(mutex);
+      timer->active = false;
+      unlink(timer);
+
+      if(timer->running)
+      {
+        if(timer->runningThread == std::this_thread::get_id())
+        {
+          timer->released = true;
+          return;
+        }
+
+        while(timer->running)
+          callbackFinished.wait(TPMc lock);
+      }
+    }
+
+    delete timer;
+  }
+};
+
+//##################################################################################################
+TimerService::TimerService(const std::string& threadName):
+  d(new Private(threadName))
+{
+
+}
+
+//##################################################################################################
+TimerService::~TimerService()
+{
+  // A timer or its callback may hold the last reference to the service, in that case this is
+  // called on the service thread which can't join itself.
+  bool serviceThread = std::this_thread::get_id() == d->thread.get_id();
+
+  d->mutex.locked(TPMc [&]
+  {
+    d->finish = true;
+    d->deleteOnExit = serviceThread;
+    d->waitCondition.wakeAll();
+  });
+
+  if(serviceThread)
+  {
+    d->thread.detach();
+    return;
+  }
+
+  d->thread.join();
+  delete d;
+}
+
+//##################################################################################################
+std::shared_ptr<TimerService> TimerService::globalInstance()
+{
+  static std::shared_ptr<TimerService> globalInstance{std::make_shared<TimerService>("Timer service")};
+  return globalInstance;
+}
+
+//##################################################################################################
+ServiceTimer::ServiceTimer(const std::function<void()>& callback, const std::shared_ptr<TimerService>& service):
+  d(new Private(callback, service))
+{
+
+}
+
+//##################################################################################################
+ServiceTimer::~ServiceTimer()
+{
+  // Keep the service alive until d has been released, d holds a reference that it may drop.
+  std::shared_ptr<TimerService> service = d->service;
+  service->d->release(d);
+}
+
+//##################################################################################################
+void ServiceTimer::start(int64_t intervalUS)
+{
+  d->service->d->start(d, intervalUS, false, MissedTickPolicy::Skip);
+}
+
+//##################################################################################################
+void ServiceTimer::startFixedRate(int64_t intervalUS, MissedTickPolicy policy)
+{
+  d->service->d->start(d, intervalUS, true, policy);
+}
+
+//##################################################################################################
+void ServiceTimer::stop()
+{
+  d->service->d->stop(d);
+}
+
+//##################################################################################################
+bool ServiceTimer::isActive() const
+{
+  return d->service->d->mutex.locked(TPMc [&]{return d->active;});
+}
+
+//##################################################################################################
+TimerJitterStats ServiceTimer::takeJitterStats()
+{
+  return d->service->d->mutex.locked(TPMc [&]{return std::exchange(d->stats, TimerJitterStats());});
+}
+
+}
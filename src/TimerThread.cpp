@@ -1,9 +1,4 @@
 #include "tp_utils/TimerThread.h"
-#include "tp_utils/MutexUtils.h"
-
-#include "lib_platform/SetThreadName.h"
-
-#include <thread>
 
 namespace tp_utils
 {
@@ -11,59 +6,33 @@ namespace tp_utils
 //##################################################################################################
 struct TimerThread::Private
 {
-  std::function<void()> callback;
-  int64_t timeoutMS;
-  const std::string threadName;
-
-  TPMutex mutex{TPM};
-  TPWaitCondition waitCondition;
-  bool finish{false};
-
-  std::thread thread;
+  ServiceTimer timer;
 
   //################################################################################################
-  Private(const std::function<void()>& callback_, int64_t timeoutMS_, const std::string& threadName_):
-    callback(callback_),
-    timeoutMS(timeoutMS_),
-    threadName(threadName_),
-    thread([&]{run();})
+  Private(const std::function<void()>& callback, int64_t intervalUS, MissedTickPolicy policy):
+    timer(callback)
   {
-
-  }
-
-  //################################################################################################
-  ~Private()
-  {
-    {
-      TP_MUTEX_LOCKER(mutex);
-      finish = true;
-      waitCondition.wakeAll();
-    }
-
-    thread.join();
+    timer.startFixedRate(intervalUS, policy);
   }
+};
 
-  //################################################################################################
-  void run()
-  {
-    lib_platform::setThreadName(threadName);
-    TPMutexLocker lock(mutex cTPM);
-    while(!finish)
-    {
-      waitCondition.wait(TPMc lock, timeoutMS);
+//##################################################################################################
+TimerThread::TimerThread(const std::function<void()>& callback, int64_t timeoutMS):
+  d(new Private(callback, timeoutMS*1000, MissedTickPolicy::Skip))
+{
 
-      if(!finish)
-      {
-        TP_MUTEX_UNLOCKER(lock);
-        callback();
-      }
-    }
-  }
-};
+}
 
 //##################################################################################################
 TimerThread::TimerThread(const std::function<void()>& callback, int64_t timeoutMS, const std::string& threadName):
-  d(new Private(callback, timeoutMS, threadName))
+  d(new Private(callback, timeoutMS*1000, MissedTickPolicy::Skip))
+{
+  TP_UNUSED(threadName);
+}
+
+//##################################################################################################
+TimerThread::TimerThread(const std::function<void()>& callback, std::chrono::microseconds interval, MissedTickPolicy policy):
+  d(new Private(callback, int64_t(interval.count()), policy))
 {
 
 }
@@ -74,4 +43,10 @@ TimerThread::~TimerThread()
   delete d;
 }
 
+//##################################################################################################
+TimerJitterStats TimerThread::takeJitterStats()
+{
+  return d->timer.takeJitterStats();
+}
+
 }
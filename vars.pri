@@ -53,15 +53,33 @@ HEADERS += inc/tp_utils/TimeUtils.h
 SOURCES += src/TimerThread.cpp
 HEADERS += inc/tp_utils/TimerThread.h
 
+SOURCES += src/TimerService.cpp
+HEADERS += inc/tp_utils/TimerService.h
+
 SOURCES += src/AbstractCrossThreadCallback.cpp
 HEADERS += inc/tp_utils/AbstractCrossThreadCallback.h
 
+SOURCES += src/EventFdCrossThreadCallback.cpp
+HEADERS += inc/tp_utils/EventFdCrossThreadCallback.h
+
 SOURCES += src/AbstractTimerCallback.cpp
 HEADERS += inc/tp_utils/AbstractTimerCallback.h
 
 SOURCES += src/Progress.cpp
 HEADERS += inc/tp_utils/Progress.h
 
+SOURCES += src/MappedProgressStore.cpp
+HEADERS += inc/tp_utils/MappedProgressStore.h
+
+SOURCES += src/ProgressEventCodec.cpp
+HEADERS += inc/tp_utils/ProgressEventCodec.h
+
+SOURCES += src/ChromeTrace.cpp
+HEADERS += inc/tp_utils/ChromeTrace.h
+
+SOURCES += src/SamplingProfiler.cpp
+HEADERS += inc/tp_utils/SamplingProfiler.h
+
 SOURCES += src/Profiler.cpp
 HEADERS += inc/tp_utils/Profiler.h
 
@@ -82,8 +100,14 @@ HEADERS += inc/tp_utils/Garbage.h
 
 HEADERS += inc/tp_utils/Parallel.h
 
+HEADERS += inc/tp_utils/LockFreeQueue.h
+
 HEADERS += inc/tp_utils/CallbackCollection.h
 
+HEADERS += inc/tp_utils/SmallFunction.h
+
+HEADERS += inc/tp_utils/ConcurrentCallbackCollection.h
+
 HEADERS += inc/tp_utils/Interface.h
 
 HEADERS += inc/tp_utils/TPPixel.h
@@ -101,6 +125,7 @@ HEADERS += inc/tp_utils/detail/log_stats/function_time.h
 HEADERS += inc/tp_utils/detail/log_stats/mutex_time.h
 HEADERS += inc/tp_utils/detail/log_stats/ref_count.h
 HEADERS += inc/tp_utils/detail/log_stats/virtual_memory.h
+HEADERS += inc/tp_utils/detail/log_stats/garbage.h
 
 HEADERS += inc/tp_utils/ExtendArgs.h
 